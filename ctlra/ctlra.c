@@ -1,7 +1,14 @@
+/* for pthread_attr_setaffinity_np() */
+#define _GNU_SOURCE
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "config.h"
 
@@ -12,18 +19,60 @@
 struct ctlra_dev_connect_func_t __ctlra_devices[CTLRA_MAX_DEVICES];
 uint32_t __ctlra_device_count;
 
+/* Open addressed hash of VID:PID to driver id, so matching a USB device
+ * to its driver costs the same regardless of how many are registered.
+ * Slots store the driver id + 1, with 0 marking an empty slot. */
+#define CTLRA_DEV_HASH_BITS 7
+#define CTLRA_DEV_HASH_SIZE (1 << CTLRA_DEV_HASH_BITS)
+static uint8_t ctlra_dev_hash[CTLRA_DEV_HASH_SIZE];
+
+static inline uint32_t ctlra_impl_dev_hash(uint32_t vid, uint32_t pid)
+{
+	uint32_t key = (vid << 16) | (pid & 0xffff);
+	return (key * 2654435761u) >> (32 - CTLRA_DEV_HASH_BITS);
+}
+
 __attribute__((constructor(101)))
 static void ctlra_static_setup()
 {
 	/* placeholder */
 }
 
-int ctlra_impl_get_id_by_vid_pid(uint32_t vid, uint32_t pid)
+/* Runs after all drivers have registered at priority 102 */
+__attribute__((constructor(103)))
+static void ctlra_static_hash_setup()
 {
-	for(unsigned i = 0; i < __ctlra_device_count; i++) {
-		if(__ctlra_devices[i].vid == vid && __ctlra_devices[i].pid == pid) {
-			return i;
+	memset(ctlra_dev_hash, 0, sizeof(ctlra_dev_hash));
+	for(uint32_t i = 0; i < __ctlra_device_count; i++) {
+		uint32_t vid = __ctlra_devices[i].vid;
+		uint32_t pid = __ctlra_devices[i].pid;
+		/* non-USB drivers are probed individually */
+		if(vid == 0 && pid == 0)
+			continue;
+		uint32_t h = ctlra_impl_dev_hash(vid, pid);
+		while(ctlra_dev_hash[h]) {
+			uint32_t id = ctlra_dev_hash[h] - 1;
+			/* first registered driver wins, as the linear
+			 * search did previously */
+			if(__ctlra_devices[id].vid == vid &&
+			   __ctlra_devices[id].pid == pid)
+				break;
+			h = (h + 1) & (CTLRA_DEV_HASH_SIZE - 1);
 		}
+		if(!ctlra_dev_hash[h])
+			ctlra_dev_hash[h] = i + 1;
+	}
+}
+
+int ctlra_impl_get_id_by_vid_pid(uint32_t vid, uint32_t pid)
+{
+	uint32_t h = ctlra_impl_dev_hash(vid, pid);
+	while(ctlra_dev_hash[h]) {
+		uint32_t id = ctlra_dev_hash[h] - 1;
+		if(__ctlra_devices[id].vid == vid &&
+		   __ctlra_devices[id].pid == pid)
+			return id;
+		h = (h + 1) & (CTLRA_DEV_HASH_SIZE - 1);
 	}
 	return -1;
 }
@@ -45,6 +94,31 @@ int ctlra_impl_dev_get_by_vid_pid(struct ctlra_t *ctlra, int32_t vid,
 	return -1;
 }
 
+/* Appends an already connected device to the instance's device list */
+void ctlra_impl_dev_link(struct ctlra_t *ctlra, struct ctlra_dev_t *new_dev)
+{
+	new_dev->ctlra_context = ctlra;
+	new_dev->dev_list_next = 0;
+
+	if(ctlra_impl_usb_identity_bind(ctlra, new_dev))
+		CTLRA_WARN(ctlra, "failed to assign unique id to %s\n",
+			   new_dev->info.device);
+	else
+		ctlra_impl_usb_resume(ctlra, new_dev);
+
+	// if list empty, add as main ptr
+	if(ctlra->dev_list == 0) {
+		ctlra->dev_list = new_dev;
+		return;
+	}
+
+	// skip to end of list, and append
+	struct ctlra_dev_t *dev_iter = ctlra->dev_list;
+	while(dev_iter->dev_list_next)
+		dev_iter = dev_iter->dev_list_next;
+	dev_iter->dev_list_next = new_dev;
+}
+
 struct ctlra_dev_t *ctlra_dev_connect(struct ctlra_t *ctlra,
 				      ctlra_dev_connect_func connect,
 				      ctlra_event_func event_func,
@@ -55,24 +129,9 @@ struct ctlra_dev_t *ctlra_dev_connect(struct ctlra_t *ctlra,
 	/* TODO: pass ctlra instance to connect() so the ->ctlra_context
 	 * pointer is always valid */
 	new_dev = connect(event_func, userdata, future);
-	if(new_dev) {
-		new_dev->ctlra_context = ctlra;
-		new_dev->dev_list_next = 0;
-
-		// if list empty, add as main ptr
-		if(ctlra->dev_list == 0) {
-			ctlra->dev_list = new_dev;
-			return new_dev;
-		}
-
-		// skip to end of list, and append
-		struct ctlra_dev_t *dev_iter = ctlra->dev_list;
-		while(dev_iter->dev_list_next)
-			dev_iter = dev_iter->dev_list_next;
-		dev_iter->dev_list_next = new_dev;
-		return new_dev;
-	}
-	return 0;
+	if(new_dev)
+		ctlra_impl_dev_link(ctlra, new_dev);
+	return new_dev;
 }
 
 
@@ -193,12 +252,154 @@ CTLRA_DEVICE_DECL(avtka);
 
 uint32_t ctlra_dev_poll(struct ctlra_dev_t *dev)
 {
-	if(dev && dev->poll && !dev->banished) {
-		return dev->poll(dev);
+	if(!dev || dev->banished)
+		return 0;
+
+	uint32_t ret = 0;
+	if(dev->poll) {
+		/* drivers that decode input in poll (eg MIDI) may stamp
+		 * each message themselves, else poll time is used */
+		dev->event_timestamp = ctlra_impl_time_ns();
+		ret = dev->poll(dev);
+	}
+	/* end of the dispatch cycle, coalesced events are sent here */
+	ctlra_dev_impl_event_flush(dev);
+	return ret;
+}
+
+int ctlra_dev_impl_event_merge(struct ctlra_dev_t *dev,
+			       const struct ctlra_event_t *event)
+{
+	uint32_t stat;
+	switch(event->type) {
+	case CTLRA_EVENT_SLIDER:
+		stat = CTLRA_EVENT_STAT_SLIDER_MERGED;
+		break;
+	case CTLRA_EVENT_ENCODER:
+		stat = CTLRA_EVENT_STAT_ENCODER_MERGED;
+		break;
+	default:
+		/* edges of buttons and grids are always delivered */
+		return 0;
+	}
+
+	/* latest first, a moving control is usually near the end */
+	for(int32_t i = dev->event_batch_count - 1; i >= 0; i--) {
+		struct ctlra_event_t *e = &dev->event_batch[i];
+		if(e->type != event->type)
+			continue;
+
+		if(event->type == CTLRA_EVENT_SLIDER) {
+			if(e->slider.id != event->slider.id)
+				continue;
+			e->slider.value = event->slider.value;
+		} else {
+			if(e->encoder.id != event->encoder.id ||
+			   e->encoder.flags != event->encoder.flags)
+				continue;
+			if(e->encoder.flags & CTLRA_EVENT_ENCODER_FLAG_FLOAT)
+				e->encoder.delta_float += event->encoder.delta_float;
+			else
+				e->encoder.delta += event->encoder.delta;
+		}
+		e->timestamp = dev->event_timestamp;
+		dev->event_counts[stat]++;
+		return 1;
 	}
 	return 0;
 }
 
+/* Applies the batch to the state returned by ctlra_dev_get_state().
+ * Readers retry while the sequence is odd or has changed */
+static void ctlra_dev_impl_state_update(struct ctlra_dev_t *dev,
+					const struct ctlra_event_t *events,
+					uint32_t n)
+{
+	struct ctlra_dev_state_t *s = &dev->state;
+	uint32_t seq = dev->state_seq;
+
+	__atomic_store_n(&dev->state_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for(uint32_t i = 0; i < n; i++) {
+		const struct ctlra_event_t *e = &events[i];
+		switch(e->type) {
+		case CTLRA_EVENT_BUTTON: {
+			uint32_t id = e->button.id;
+			if(id >= CTLRA_EVENT_ID_MAX)
+				break;
+			if(e->button.pressed)
+				s->buttons[id / 32] |= (1u << (id % 32));
+			else
+				s->buttons[id / 32] &= ~(1u << (id % 32));
+			} break;
+		case CTLRA_EVENT_SLIDER:
+			if(e->slider.id < CTLRA_STATE_SLIDERS_MAX)
+				s->sliders[e->slider.id] = e->slider.value;
+			break;
+		case CTLRA_EVENT_ENCODER:
+			if(e->encoder.id >= CTLRA_STATE_ENCODERS_MAX)
+				break;
+			if(e->encoder.flags & CTLRA_EVENT_ENCODER_FLAG_FLOAT)
+				s->encoders[e->encoder.id] += e->encoder.delta_float;
+			else
+				s->encoders[e->encoder.id] += e->encoder.delta;
+			break;
+		default:
+			break;
+		}
+	}
+	s->timestamp = events[n-1].timestamp;
+
+	__atomic_store_n(&dev->state_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void ctlra_dev_get_state(const struct ctlra_dev_t *dev,
+			 struct ctlra_dev_state_t *state)
+{
+	if(!dev || !state)
+		return;
+
+	uint32_t seq;
+	do {
+		seq = __atomic_load_n(&dev->state_seq, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue;
+		*state = dev->state;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(seq & 1 ||
+		seq != __atomic_load_n(&dev->state_seq, __ATOMIC_RELAXED));
+}
+
+void ctlra_dev_impl_event_flush(struct ctlra_dev_t *dev)
+{
+	uint32_t n = dev->event_batch_count;
+	if(!n)
+		return;
+	dev->event_batch_count = 0;
+	dev->event_counts[CTLRA_EVENT_STAT_DISPATCHED] += n;
+
+	/* state first, so callbacks reading it see their own events */
+	ctlra_dev_impl_state_update(dev, dev->event_batch, n);
+
+	if(dev->event_ring)
+		ctlra_impl_event_ring_write(dev->event_ring, dev->event_batch,
+					    n);
+
+	if(dev->event_array_func) {
+		dev->event_array_func(dev, dev->event_batch, n,
+				      dev->event_func_userdata);
+		return;
+	}
+
+	if(!dev->event_func)
+		return;
+	for(uint32_t i = 0; i < n; i++)
+		dev->event_batch_ptrs[i] = &dev->event_batch[i];
+	dev->event_func(dev, n, dev->event_batch_ptrs,
+			dev->event_func_userdata);
+}
+
 
 void
 ctlra_dev_set_callback_userdata(struct ctlra_dev_t *dev,
@@ -217,6 +418,47 @@ ctlra_dev_set_event_func(struct ctlra_dev_t* dev, ctlra_event_func f)
 		dev->event_func = f;
 }
 
+void
+ctlra_dev_set_event_array_func(struct ctlra_dev_t* dev,
+			       ctlra_event_array_func f)
+{
+	if(dev)
+		dev->event_array_func = f;
+}
+
+void
+ctlra_dev_set_event_ring(struct ctlra_dev_t* dev,
+			 struct ctlra_event_ring_t *ring)
+{
+	if(dev)
+		dev->event_ring = ring;
+}
+
+void
+ctlra_dev_set_event_mask(struct ctlra_dev_t *dev, uint32_t type_mask,
+			 const struct ctlra_event_ids_t *ids)
+{
+	if(!dev)
+		return;
+	dev->event_type_skip = ~type_mask & CTLRA_EVENT_MASK_ALL;
+	dev->event_type_optional = type_mask & ~CTLRA_EVENT_MASK_ALL;
+	for(int t = 0; t < CTLRA_EVENT_T_COUNT; t++) {
+		for(int w = 0; w < CTLRA_EVENT_ID_MAX / 32; w++)
+			dev->event_ids_skip.ids[t][w] = ids ? ~ids->ids[t][w] : 0;
+	}
+}
+
+void
+ctlra_dev_set_coalesce(struct ctlra_dev_t* dev, uint8_t enable)
+{
+	if(!dev)
+		return;
+	/* don't hold back events already batched without coalescing */
+	if(!enable)
+		ctlra_dev_impl_event_flush(dev);
+	dev->event_coalesce = enable ? 1 : 0;
+}
+
 void
 ctlra_dev_set_feedback_func(struct ctlra_dev_t *dev,
 			    ctlra_feedback_func func)
@@ -252,6 +494,27 @@ int32_t ctlra_dev_disconnect(struct ctlra_dev_t *dev)
 			dev->remove_func(dev, dev->banished,
 					 dev->event_func_userdata);
 
+		/* the identity is kept, for when the device returns */
+		ctlra_impl_usb_identity_unbind(ctlra, dev);
+
+		CTLRA_INFO(ctlra, "[%s] lights set %u, suppressed %u, "
+			   "flushes %u, suppressed %u\n", dev->info.device,
+			   dev->light_counts[CTLRA_LIGHT_STAT_SET],
+			   dev->light_counts[CTLRA_LIGHT_STAT_SET_SUPPRESSED],
+			   dev->light_counts[CTLRA_LIGHT_STAT_FLUSH],
+			   dev->light_counts[CTLRA_LIGHT_STAT_FLUSH_SUPPRESSED]);
+		free(dev->light_anim);
+		dev->light_anim = 0;
+		dev->light_anim_count = 0;
+
+		if(dev->event_coalesce)
+			CTLRA_INFO(ctlra, "[%s] events dispatched %u, "
+				   "sliders merged %u, encoders merged %u\n",
+				   dev->info.device,
+				   dev->event_counts[CTLRA_EVENT_STAT_DISPATCHED],
+				   dev->event_counts[CTLRA_EVENT_STAT_SLIDER_MERGED],
+				   dev->event_counts[CTLRA_EVENT_STAT_ENCODER_MERGED]);
+
 		if(dev_iter == dev) {
 			ctlra->dev_list = dev_iter->dev_list_next;
 			return dev->disconnect(dev);
@@ -273,39 +536,310 @@ int32_t ctlra_dev_disconnect(struct ctlra_dev_t *dev)
 	return -ENOTSUP;
 }
 
+/* Update the shadow and pass the status to the driver if it changed */
+static void ctlra_impl_light_write(struct ctlra_dev_t *dev, uint32_t light_id,
+				   uint32_t light_status)
+{
+	/* apps often set every light each iteration, only pass changes */
+	if(light_id < CTLRA_LIGHT_SHADOW_MAX) {
+		uint32_t bit = 1u << (light_id % 32);
+		uint32_t *set = &dev->light_shadow_set[light_id / 32];
+		if((*set & bit) && dev->light_shadow[light_id] == light_status) {
+			dev->light_counts[CTLRA_LIGHT_STAT_SET_SUPPRESSED]++;
+			return;
+		}
+		*set |= bit;
+		dev->light_shadow[light_id] = light_status;
+	}
+
+	dev->light_counts[CTLRA_LIGHT_STAT_SET]++;
+	dev->light_changed = 1;
+	dev->light_set(dev, light_id, light_status);
+}
+
+static void ctlra_impl_light_anim_stop(struct ctlra_dev_t *dev,
+				       uint32_t light_id)
+{
+	if(!dev->light_anim || light_id >= CTLRA_LIGHT_SHADOW_MAX)
+		return;
+	struct ctlra_light_anim_t *a = &dev->light_anim[light_id];
+	if(a->type != CTLRA_LIGHT_ANIM_NONE) {
+		a->type = CTLRA_LIGHT_ANIM_NONE;
+		dev->light_anim_count--;
+	}
+}
+
 void ctlra_dev_light_set(struct ctlra_dev_t *dev, uint32_t light_id,
 			uint32_t light_status)
 {
-	if(dev && dev->light_set)
-		dev->light_set(dev, light_id, light_status);
+	if(!dev || !dev->light_set)
+		return;
+
+	if(light_status & (1u << 31)) {
+		uint32_t status = light_status & ~(1u << 31);
+		/* apps resend the blinking status each iteration, which
+		 * must not restart the blink */
+		if(dev->light_anim && light_id < CTLRA_LIGHT_SHADOW_MAX) {
+			struct ctlra_light_anim_t *a = &dev->light_anim[light_id];
+			if(a->type == CTLRA_LIGHT_ANIM_BLINK &&
+			   a->status == status) {
+				dev->light_counts[CTLRA_LIGHT_STAT_SET_SUPPRESSED]++;
+				return;
+			}
+		}
+		if(ctlra_dev_light_animate(dev, light_id, status,
+					   CTLRA_LIGHT_ANIM_BLINK,
+					   CTLRA_LIGHT_BLINK_MS, 0) == 0)
+			return;
+		/* can't animate this light, show it steady */
+		light_status = status;
+	}
+
+	ctlra_impl_light_anim_stop(dev, light_id);
+	ctlra_impl_light_write(dev, light_id, light_status);
+}
+
+void ctlra_dev_lights_set_range(struct ctlra_dev_t *dev, uint32_t first_id,
+				uint32_t count, const uint32_t *status)
+{
+	if(!dev || !status || (!dev->lights_set_range && !dev->light_set))
+		return;
+
+	/* blinks and running animations are handled light by light */
+	int per_light = dev->light_anim_count > 0;
+	for(uint32_t i = 0; i < count && !per_light; i++)
+		per_light = (status[i] >> 31) & 1;
+	if(per_light) {
+		for(uint32_t i = 0; i < count; i++)
+			ctlra_dev_light_set(dev, first_id + i, status[i]);
+		return;
+	}
+
+	/* trim unchanged lights from both ends of the span, updating the
+	 * shadow for the lights that do change */
+	uint32_t lo = count;
+	uint32_t hi = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		uint32_t id = first_id + i;
+		if(id < CTLRA_LIGHT_SHADOW_MAX) {
+			uint32_t bit = 1u << (id % 32);
+			uint32_t *set = &dev->light_shadow_set[id / 32];
+			if((*set & bit) && dev->light_shadow[id] == status[i]) {
+				dev->light_counts[CTLRA_LIGHT_STAT_SET_SUPPRESSED]++;
+				continue;
+			}
+			*set |= bit;
+			dev->light_shadow[id] = status[i];
+		}
+		dev->light_counts[CTLRA_LIGHT_STAT_SET]++;
+		if(lo == count)
+			lo = i;
+		hi = i + 1;
+	}
+	if(lo == count)
+		return;
+
+	dev->light_changed = 1;
+	if(dev->lights_set_range) {
+		dev->lights_set_range(dev, first_id + lo, hi - lo, &status[lo]);
+		return;
+	}
+
+	/* no native range: an unchanged light in the span is harmless to
+	 * set again, so only the trimmed span is walked */
+	for(uint32_t i = lo; i < hi; i++)
+		dev->light_set(dev, first_id + i, status[i]);
+}
+
+int32_t ctlra_dev_light_animate(struct ctlra_dev_t *dev, uint32_t light_id,
+				uint32_t light_status,
+				enum ctlra_light_anim_type_t type,
+				uint32_t period_ms, float phase)
+{
+	if(!dev || !dev->light_set)
+		return -ENOTSUP;
+	if(light_id >= CTLRA_LIGHT_SHADOW_MAX)
+		return -EINVAL;
+
+	if(type == CTLRA_LIGHT_ANIM_NONE) {
+		ctlra_impl_light_anim_stop(dev, light_id);
+		return 0;
+	}
+	if(type > CTLRA_LIGHT_ANIM_FADE || period_ms == 0)
+		return -EINVAL;
+
+	if(!dev->light_anim) {
+		dev->light_anim = calloc(CTLRA_LIGHT_SHADOW_MAX,
+					 sizeof(struct ctlra_light_anim_t));
+		if(!dev->light_anim)
+			return -ENOMEM;
+	}
+
+	uint64_t now = ctlra_impl_time_ns();
+	if(dev->light_anim_base_ns == 0)
+		dev->light_anim_base_ns = now;
+
+	struct ctlra_light_anim_t *a = &dev->light_anim[light_id];
+	if(a->type == CTLRA_LIGHT_ANIM_NONE) {
+		dev->light_anim_count++;
+		/* show the new animation without waiting for a tick */
+		dev->light_anim_next_ns = now;
+	}
+	a->status = light_status & ~(1u << 31);
+	a->period_ns = period_ms * 1000000ull;
+	a->phase = phase;
+	a->type = type;
+	a->start_ns = now;
+
+	return 0;
+}
+
+int32_t ctlra_dev_lights_animate_range(struct ctlra_dev_t *dev,
+				       uint32_t first_id, uint32_t count,
+				       const uint32_t *status,
+				       enum ctlra_light_anim_type_t type,
+				       uint32_t period_ms, float phase)
+{
+	if(!status)
+		return -EINVAL;
+
+	for(uint32_t i = 0; i < count; i++) {
+		int32_t ret = ctlra_dev_light_animate(dev, first_id + i,
+						      status[i], type,
+						      period_ms, phase);
+		if(ret)
+			return ret;
+	}
+	return 0;
+}
+
+void ctlra_dev_lights_anim_sync(struct ctlra_dev_t *dev, uint64_t time_ns)
+{
+	if(!dev)
+		return;
+	dev->light_anim_base_ns = time_ns ? time_ns : ctlra_impl_time_ns();
+	dev->light_anim_next_ns = 0;
+}
+
+/* Returns the status of animated light *a* at time *now*, and sets
+ * *done* when a one-shot animation has finished */
+static uint32_t ctlra_impl_light_anim_status(struct ctlra_dev_t *dev,
+					     struct ctlra_light_anim_t *a,
+					     uint64_t now, int *done)
+{
+	const int64_t period = a->period_ns;
+	const uint32_t bright = (a->status >> 24) & 0x7F;
+	const uint32_t colour = a->status & 0xFFFFFF;
+	uint32_t level;
+
+	if(a->type == CTLRA_LIGHT_ANIM_FADE) {
+		int64_t t = now - a->start_ns;
+		if(t >= period) {
+			*done = 1;
+			return 0;
+		}
+		level = bright * (period - t) / period;
+		return level ? (level << 24) | colour : 0;
+	}
+
+	/* position in the period, which may start after now when synced
+	 * to an upcoming beat */
+	int64_t t = (int64_t)(now - dev->light_anim_base_ns) +
+		    (int64_t)(a->phase * period);
+	int64_t pos = ((t % period) + period) % period;
+
+	if(a->type == CTLRA_LIGHT_ANIM_BLINK)
+		return pos < period / 2 ? a->status : 0;
+
+	/* pulse: down from full brightness to off at half the period,
+	 * and back up */
+	int64_t dist = pos < period / 2 ? pos : period - pos;
+	level = bright * (period - 2 * dist) / period;
+	return level ? (level << 24) | colour : 0;
+}
+
+static void ctlra_impl_light_anim_tick(struct ctlra_dev_t *dev, uint64_t now)
+{
+	if(!dev->light_anim_count || now < dev->light_anim_next_ns)
+		return;
+	dev->light_anim_next_ns = now + CTLRA_LIGHT_ANIM_MS * 1000000ull;
+
+	for(uint32_t i = 0; i < CTLRA_LIGHT_SHADOW_MAX; i++) {
+		struct ctlra_light_anim_t *a = &dev->light_anim[i];
+		if(a->type == CTLRA_LIGHT_ANIM_NONE)
+			continue;
+		int done = 0;
+		uint32_t status = ctlra_impl_light_anim_status(dev, a, now,
+							       &done);
+		if(done) {
+			a->type = CTLRA_LIGHT_ANIM_NONE;
+			dev->light_anim_count--;
+		}
+		/* the shadow drops the ticks where the state holds */
+		ctlra_impl_light_write(dev, i, status);
+	}
+
+	ctlra_dev_light_flush(dev, 0);
 }
 
 void ctlra_dev_feedback_set(struct ctlra_dev_t *dev, uint32_t fb_id,
 			    float value)
 {
-	if(dev && dev->feedback_set)
+	if(dev && dev->feedback_set) {
+		dev->light_changed = 1;
 		dev->feedback_set(dev, fb_id, value);
+	}
 }
 
 void ctlra_dev_feedback_digits(struct ctlra_dev_t *dev,
 			       uint32_t feedback_id,
 			       float value)
 {
-	if(dev && dev->feedback_digits)
+	if(dev && dev->feedback_digits) {
+		dev->light_changed = 1;
 		dev->feedback_digits(dev, feedback_id, value);
+	}
 }
 
 void ctlra_dev_light_flush(struct ctlra_dev_t *dev, uint32_t force)
 {
-	if(dev && dev->light_flush)
-		dev->light_flush(dev, force);
+	if(!dev || !dev->light_flush)
+		return;
+
+	if(!force && !dev->light_changed) {
+		dev->light_counts[CTLRA_LIGHT_STAT_FLUSH_SUPPRESSED]++;
+		return;
+	}
+
+	dev->light_counts[CTLRA_LIGHT_STAT_FLUSH]++;
+	dev->light_changed = 0;
+	dev->light_flush(dev, force);
 }
 
 void ctlra_dev_grid_light_set(struct ctlra_dev_t *dev, uint32_t grid_id,
 			     uint32_t light_id, uint32_t light_status)
 {
-	if(dev && dev->grid_light_set)
+	if(dev && dev->grid_light_set) {
+		dev->light_changed = 1;
 		dev->grid_light_set(dev, grid_id, light_id, light_status);
+	}
+}
+
+void ctlra_dev_grid_lights_set_frame(struct ctlra_dev_t *dev,
+				     uint32_t grid_id, uint32_t count,
+				     const uint32_t *status)
+{
+	if(!dev || !status)
+		return;
+
+	if(dev->grid_lights_set_frame) {
+		dev->light_changed = 1;
+		dev->grid_lights_set_frame(dev, grid_id, count, status);
+		return;
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+		ctlra_dev_grid_light_set(dev, grid_id, i, status[i]);
 }
 
 int32_t ctlra_screen_get_data(struct ctlra_dev_t *dev,
@@ -379,6 +913,10 @@ struct ctlra_t *ctlra_create(const struct ctlra_create_opts_t *opts)
 		CTLRA_INFO(c, "Cairo: %s\n", CTLRA_OPT_CAIRO);
 	}
 
+	c->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(c->wake_fd < 0)
+		CTLRA_ERROR(c, "failed to create wake eventfd: %d\n", errno);
+
 	/* register USB hotplug etc */
 	int err = ctlra_dev_impl_usb_init(c);
 	if(err)
@@ -387,41 +925,304 @@ struct ctlra_t *ctlra_create(const struct ctlra_create_opts_t *opts)
 	return c;
 }
 
+int ctlra_impl_accept_connected(struct ctlra_t *ctlra,
+				struct ctlra_dev_t *dev)
+{
+	if(!dev)
+		return 0;
+
+	ctlra_impl_dev_link(ctlra, dev);
+
+	/* Application sets function pointers directly to device */
+	int accepted = ctlra->accept_dev_func(ctlra,
+					      &dev->info,
+					      dev,
+					      ctlra->accept_dev_func_userdata);
+
+	CTLRA_INFO(ctlra, "%s %s %s accepted\n", dev->info.vendor,
+		   dev->info.device, accepted ? "" : "not");
+
+	if(!accepted) {
+		ctlra_dev_disconnect(dev);
+		return 0;
+	}
+	return 1;
+}
+
 int ctlra_impl_accept_dev(struct ctlra_t *ctlra,
-			  int id)
+			  int id, void *future)
 {
 	if(id < 0 || id >= __ctlra_device_count || !__ctlra_devices[id].connect) {
 		CTLRA_WARN(ctlra, "invalid device id recieved %d\n", id);
 		return 0;
 	}
 
-	struct ctlra_dev_t* dev = ctlra_dev_connect(ctlra,
-						    __ctlra_devices[id].connect,
-						    0x0,
-						    0 /* userdata */,
-						    0x0);
-	if(dev) {
-		/* Store the ctlra context into the dev pointer */
-		dev->ctlra_context = ctlra;
+	struct ctlra_dev_t *dev = __ctlra_devices[id].connect(0x0,
+							      0 /* userdata */,
+							      future);
+	return ctlra_impl_accept_connected(ctlra, dev);
+}
+
+/* Rate at which feedback_func is called without input, matching a
+ * typical idle_iter loop, see flags_feedback_on_input */
+#define CTLRA_FEEDBACK_MS 10
+/* Interval between screen redraws */
+#define CTLRA_SCREEN_REDRAW_NS 100000000
+/* Upper bound of fds the I/O thread waits on */
+#define CTLRA_IO_POLLFDS_MAX 64
+
+struct ctlra_io_t {
+	pthread_t thread;
+	/* *held* is owned by the thread for each iteration, and by the
+	 * application through ctlra_io_lock(). *lock* only guards *held*
+	 * and *waiters*, blocked threads wait on *cond* */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t held;
+	/* count of application threads in ctlra_io_lock(). The thread
+	 * does not take *held* while there are any, so they are handed
+	 * it between iterations without the thread spinning */
+	uint32_t waiters;
+	uint8_t quit;
+};
+
+static void ctlra_impl_idle_iter(struct ctlra_t *ctlra);
+
+static void ctlra_impl_wake(struct ctlra_t *ctlra)
+{
+	uint64_t one = 1;
+	ssize_t r = write(ctlra->wake_fd, &one, sizeof(one));
+	(void)r;
+}
 
-		/* Application sets function pointers directly to device */
-		int accepted = ctlra->accept_dev_func(ctlra,
-						      &dev->info,
-						      dev,
-						      ctlra->accept_dev_func_userdata);
+int32_t ctlra_get_pollfds(struct ctlra_t *ctlra, struct pollfd *fds,
+			  uint32_t max)
+{
+	int32_t n = 0;
 
-		CTLRA_INFO(ctlra, "%s %s %s accepted\n", dev->info.vendor,
-			   dev->info.device, accepted ? "" : "not");
+	if(max > 0) {
+		fds[0].fd = ctlra->wake_fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+	}
+	n++;
 
-		if(!accepted) {
-			ctlra_dev_disconnect(dev);
-			return 0;
+	/* once *fds* is full, the rest are only counted */
+	uint32_t room = n < max ? max - n : 0;
+	int32_t usb = ctlra_impl_usb_get_pollfds(ctlra, room ? &fds[n] : 0,
+						 room);
+	if(usb > 0)
+		n += usb;
+
+	struct ctlra_dev_t *dev_iter = ctlra->dev_list;
+	for(; dev_iter; dev_iter = dev_iter->dev_list_next) {
+		if(dev_iter->banished || !dev_iter->get_pollfds)
+			continue;
+		room = n < max ? max - n : 0;
+		int32_t dev_fds = dev_iter->get_pollfds(dev_iter,
+							room ? &fds[n] : 0,
+							room);
+		if(dev_fds > 0)
+			n += dev_fds;
+	}
+
+	return n;
+}
+
+int32_t ctlra_get_timeout(struct ctlra_t *ctlra)
+{
+	int32_t timeout = ctlra_impl_usb_get_timeout(ctlra);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+	struct ctlra_dev_t *dev_iter = ctlra->dev_list;
+	for(; dev_iter; dev_iter = dev_iter->dev_list_next) {
+		int32_t t = -1;
+		if(dev_iter->banished)
+			continue;
+
+		/* not USB and no fd to wait on, so poll() must be called
+		 * regularly to see input */
+		if(!dev_iter->usb_handle[0] && dev_iter->poll &&
+		   !dev_iter->get_pollfds)
+			t = 1;
+		/* input reads to re-arm, see ctlra_impl_usb_read_rearm() */
+		else if(dev_iter->usb_read_armed < dev_iter->usb_read_count)
+			t = CTLRA_FEEDBACK_MS;
+		else if(dev_iter->feedback_func &&
+			!ctlra->opts.flags_feedback_on_input)
+			t = CTLRA_FEEDBACK_MS;
+
+		if(dev_iter->light_anim_count) {
+			uint64_t now_ns = ctlra_impl_time_ns();
+			uint64_t next = dev_iter->light_anim_next_ns;
+			int32_t anim = next > now_ns ?
+				(next - now_ns + 999999) / 1000000 : 0;
+			if(t < 0 || anim < t)
+				t = anim;
 		}
-		return 1;
+
+		if(dev_iter->screen_redraw_cb) {
+			int64_t elapsed =
+				(now.tv_sec - dev_iter->screen_last_redraw.tv_sec) *
+				1000000000ll +
+				(now.tv_nsec - dev_iter->screen_last_redraw.tv_nsec);
+			int64_t left = CTLRA_SCREEN_REDRAW_NS - elapsed;
+			int32_t screen = left > 0 ? (left + 999999) / 1000000 : 0;
+			if(t < 0 || screen < t)
+				t = screen;
+		}
+
+		if(t >= 0 && (timeout < 0 || t < timeout))
+			timeout = t;
+	}
+
+	return timeout;
+}
+
+static void ctlra_impl_io_release(struct ctlra_io_t *io)
+{
+	pthread_mutex_lock(&io->lock);
+	io->held = 0;
+	pthread_cond_broadcast(&io->cond);
+	pthread_mutex_unlock(&io->lock);
+}
+
+void ctlra_io_lock(struct ctlra_t *ctlra)
+{
+	struct ctlra_io_t *io = ctlra->io;
+	if(!io)
+		return;
+	pthread_mutex_lock(&io->lock);
+	io->waiters++;
+	while(io->held)
+		pthread_cond_wait(&io->cond, &io->lock);
+	io->waiters--;
+	io->held = 1;
+	pthread_mutex_unlock(&io->lock);
+}
+
+void ctlra_io_unlock(struct ctlra_t *ctlra)
+{
+	struct ctlra_io_t *io = ctlra->io;
+	if(!io)
+		return;
+	ctlra_impl_io_release(io);
+	/* wake the thread, so changes made under the lock are flushed */
+	ctlra_impl_wake(ctlra);
+}
+
+static void *ctlra_impl_io_thread(void *data)
+{
+	struct ctlra_t *ctlra = data;
+	struct ctlra_io_t *io = ctlra->io;
+
+	struct pollfd fds[CTLRA_IO_POLLFDS_MAX];
+	const uint8_t busy = ctlra->opts.flags_io_busy_poll;
+
+	while(!__atomic_load_n(&io->quit, __ATOMIC_ACQUIRE)) {
+		int32_t nfds = 0;
+		int32_t timeout = 0;
+
+		/* application threads waiting in ctlra_io_lock() go
+		 * first. Block until they are done: yielding would not let
+		 * a lower priority thread on this CPU run */
+		pthread_mutex_lock(&io->lock);
+		while(io->held || io->waiters)
+			pthread_cond_wait(&io->cond, &io->lock);
+		io->held = 1;
+		pthread_mutex_unlock(&io->lock);
+
+		ctlra_impl_idle_iter(ctlra);
+		if(!busy) {
+			nfds = ctlra_get_pollfds(ctlra, fds,
+						 CTLRA_IO_POLLFDS_MAX);
+			timeout = ctlra_get_timeout(ctlra);
+		}
+		ctlra_impl_io_release(io);
+
+		if(busy)
+			continue;
+		if(nfds > CTLRA_IO_POLLFDS_MAX) {
+			CTLRA_WARN(ctlra, "%d fds, waiting on first %d\n",
+				   nfds, CTLRA_IO_POLLFDS_MAX);
+			nfds = CTLRA_IO_POLLFDS_MAX;
+		}
+		poll(fds, nfds, timeout);
 	}
 	return 0;
 }
 
+static int ctlra_impl_io_start(struct ctlra_t *ctlra)
+{
+	struct ctlra_io_t *io = calloc(1, sizeof(struct ctlra_io_t));
+	if(!io)
+		return -ENOMEM;
+
+	pthread_mutex_init(&io->lock, 0);
+	pthread_cond_init(&io->cond, 0);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	uint8_t prio = ctlra->opts.io_thread_priority;
+	if(prio) {
+		struct sched_param param = { .sched_priority = prio };
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	uint8_t cpu = ctlra->opts.io_thread_cpu;
+	if(cpu) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu - 1, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	/* the thread reads ctlra->io, so it must be set first */
+	ctlra->io = io;
+	int ret = pthread_create(&io->thread, &attr, ctlra_impl_io_thread,
+				 ctlra);
+	if(ret == EPERM && prio) {
+		CTLRA_WARN(ctlra, "SCHED_FIFO priority %d not permitted, "
+			   "I/O thread runs at normal priority\n", prio);
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		ret = pthread_create(&io->thread, &attr,
+				     ctlra_impl_io_thread, ctlra);
+	}
+	pthread_attr_destroy(&attr);
+
+	if(ret) {
+		ctlra->io = 0;
+		pthread_cond_destroy(&io->cond);
+		pthread_mutex_destroy(&io->lock);
+		free(io);
+		return -ret;
+	}
+
+	CTLRA_INFO(ctlra, "I/O thread started, priority %d, cpu %d, %s\n",
+		   prio, (int)cpu - 1,
+		   ctlra->opts.flags_io_busy_poll ? "busy poll" : "blocking");
+	return 0;
+}
+
+static void ctlra_impl_io_stop(struct ctlra_t *ctlra)
+{
+	struct ctlra_io_t *io = ctlra->io;
+	if(!io)
+		return;
+
+	__atomic_store_n(&io->quit, 1, __ATOMIC_RELEASE);
+	ctlra_impl_wake(ctlra);
+	pthread_join(io->thread, 0);
+
+	ctlra->io = 0;
+	pthread_cond_destroy(&io->cond);
+	pthread_mutex_destroy(&io->lock);
+	free(io);
+}
+
 int ctlra_probe(struct ctlra_t *ctlra,
 		ctlra_accept_dev_func accept_func,
 		void *userdata)
@@ -431,10 +1232,20 @@ int ctlra_probe(struct ctlra_t *ctlra,
 	uint32_t i = 0;
 	int num_accepted = 0;
 
+	ctlra_io_lock(ctlra);
+
 	ctlra->accept_dev_func = accept_func;
 	ctlra->accept_dev_func_userdata = userdata;
+
+	/* USB devices are found by a single scan of the bus, instead of
+	 * each driver enumerating all devices looking for its VID:PID */
+	num_accepted += ctlra_impl_usb_probe(ctlra);
+
+	/* Drivers without a USB VID:PID are probed individually */
 	for(; i < __ctlra_device_count; i++) {
-		num_accepted += ctlra_impl_accept_dev(ctlra, i);
+		if(__ctlra_devices[i].vid || __ctlra_devices[i].pid)
+			continue;
+		num_accepted += ctlra_impl_accept_dev(ctlra, i, 0x0);
 	}
 
 	/* virtualize device from ENV variable */
@@ -450,16 +1261,40 @@ int ctlra_probe(struct ctlra_t *ctlra,
 		num_accepted += (ret == 0);
 	}
 
+	ctlra_io_unlock(ctlra);
+
+	/* devices have their callbacks now, hand them to the I/O thread */
+	if(ctlra->opts.flags_io_thread && !ctlra->io) {
+		int ret = ctlra_impl_io_start(ctlra);
+		if(ret)
+			CTLRA_ERROR(ctlra, "failed to start I/O thread: %d\n",
+				    ret);
+	}
+
 	return num_accepted;
 }
 
 void ctlra_idle_iter(struct ctlra_t *ctlra)
 {
+	/* the I/O thread iterates by itself */
+	if(ctlra->io)
+		return;
+	ctlra_impl_idle_iter(ctlra);
+}
+
+static void ctlra_impl_idle_iter(struct ctlra_t *ctlra)
+{
+	/* clear the wake, this iteration does the work it signalled */
+	uint64_t value;
+	ssize_t r = read(ctlra->wake_fd, &value, sizeof(value));
+	(void)r;
+
 	ctlra_impl_usb_idle_iter(ctlra);
 
 	/* Poll events from all */
 	struct ctlra_dev_t *dev_iter = ctlra->dev_list;
 	while(dev_iter) {
+		ctlra_impl_usb_read_rearm(dev_iter);
 		int poll = ctlra_dev_poll(dev_iter);
 		dev_iter = dev_iter->dev_list_next;
 		if(dev_iter == 0)
@@ -479,6 +1314,8 @@ void ctlra_idle_iter(struct ctlra_t *ctlra)
 				dev_iter->event_func_userdata);
 		}
 
+		ctlra_impl_light_anim_tick(dev_iter, ctlra_impl_time_ns());
+
 		struct timespec now;
 		int err = clock_gettime(CLOCK_MONOTONIC_RAW, &now);
 		if(err)
@@ -488,7 +1325,7 @@ void ctlra_idle_iter(struct ctlra_t *ctlra)
 		time_t secs = now.tv_sec  - dev_iter->screen_last_redraw.tv_sec;
 		long nanos  = now.tv_nsec - dev_iter->screen_last_redraw.tv_nsec;
 		uint64_t nanos_elapsed = secs * 1e9 + nanos;
-		uint64_t fps_in_nanos = 100000000;
+		uint64_t fps_in_nanos = CTLRA_SCREEN_REDRAW_NS;
 
 		if(dev_iter->screen_redraw_cb && fps_in_nanos < nanos_elapsed) {
 			dev_iter->screen_last_redraw = now;
@@ -539,6 +1376,12 @@ void ctlra_idle_iter(struct ctlra_t *ctlra)
 		ctlra_dev_disconnect(ctlra->banished_list);
 		ctlra->banished_list = tmp;
 	}
+
+	/* connect or remove hotplugged devices, a few per iteration so
+	 * that input latency of existing devices stays flat. Any left over
+	 * wake the application or I/O thread for another iteration */
+	if(ctlra_impl_usb_hotplug_process(ctlra))
+		ctlra_impl_wake(ctlra);
 }
 
 void ctlra_dev_impl_banish(struct ctlra_dev_t *dev)
@@ -559,6 +1402,9 @@ void ctlra_dev_impl_banish(struct ctlra_dev_t *dev)
 
 void ctlra_exit(struct ctlra_t *ctlra)
 {
+	/* devices are disconnected from this thread from here on */
+	ctlra_impl_io_stop(ctlra);
+
 	/* Ensures idle_iter is ran before cleanup to try handle any
 	 * pending reads/writes */
 	ctlra_idle_iter(ctlra);
@@ -572,6 +1418,8 @@ void ctlra_exit(struct ctlra_t *ctlra)
 
 	ctlra_impl_usb_shutdown(ctlra);
 
+	if(ctlra->wake_fd >= 0)
+		close(ctlra->wake_fd);
 	free(ctlra);
 }
 
@@ -94,15 +94,74 @@ struct ctlra_t;
 struct ctlra_create_opts_t {
 	/* creation time flags */
 	uint8_t flags_usb_no_own_context : 1;
-	uint8_t flags_usb_unsued : 7;
+	/* open and claim devices found by ctlra_probe() concurrently on a
+	 * pool of worker threads. The accept_dev_func callbacks are still
+	 * called from the thread calling ctlra_probe(), in bus order */
+	uint8_t flags_usb_parallel_open : 1;
+	/* run ctlra_idle_iter() on an internal I/O thread, started by
+	 * ctlra_probe(). The thread sleeps until a device has data, and
+	 * all callbacks are called from it. See ctlra_io_lock() */
+	uint8_t flags_io_thread : 1;
+	/* with flags_io_thread, spin instead of sleeping. This costs a
+	 * full core, so set io_thread_cpu to keep it off the audio cores */
+	uint8_t flags_io_busy_poll : 1;
+	/* the feedback functions only show state changed by input events,
+	 * so ctlra_get_timeout() and the I/O thread don't wake to call them
+	 * periodically. Screen redraws are unaffected */
+	uint8_t flags_feedback_on_input : 1;
+	uint8_t flags_usb_unsued : 3;
 
 	/* debug verbosity */
 	uint8_t debug_level;
 
+	/* number of worker threads for flags_usb_parallel_open, 0 for the
+	 * default of 4 */
+	uint8_t usb_open_threads;
+
+	/* milliseconds that the lights set on a device, and the last frame
+	 * flushed to each of its screens, are kept after it is unplugged.
+	 * If the same unit (by serial, or else by port) returns within this
+	 * time, the state is sent to it immediately on reconnect. 0 disables
+	 * the cache */
+	uint16_t resume_grace_ms;
+
+	/* SCHED_FIFO priority of the I/O thread, 0 for a normal thread.
+	 * Falls back to a normal thread if not permitted */
+	uint8_t io_thread_priority;
+	/* CPU that the I/O thread is pinned to plus one, 0 for any CPU */
+	uint8_t io_thread_cpu;
+
 	/* reserve lots of space */
-	uint8_t padding[62];
+	uint8_t padding[56];
 };
 
+#define CTLRA_STATE_SLIDERS_MAX  64
+#define CTLRA_STATE_ENCODERS_MAX 32
+
+/** Current value of the controls of a device, see ctlra_dev_get_state().
+ * Controls with ids beyond the arrays are not tracked */
+struct ctlra_dev_state_t {
+	/** bit N is set while the button with id N is pressed */
+	uint32_t buttons[CTLRA_EVENT_ID_MAX / 32];
+	/** last absolute position of each slider */
+	float sliders[CTLRA_STATE_SLIDERS_MAX];
+	/** sum of all deltas of each encoder since it was connected, in
+	 * steps for stepped encoders and rotations for endless ones */
+	float encoders[CTLRA_STATE_ENCODERS_MAX];
+	/** timestamp of the latest event included, see ctlra_event_t */
+	uint64_t timestamp;
+};
+
+/** Copy the current state of all controls of *dev* into *state*. The
+ * state is updated by the thread handling the device each time events
+ * are delivered, and published with a sequence lock, so this function
+ * never blocks the updating thread and always returns a consistent
+ * snapshot. It takes no locks and does not allocate, so it may be called
+ * from any thread, including a realtime audio thread. Only controls
+ * subscribed to with ctlra_dev_set_event_mask() are tracked */
+void ctlra_dev_get_state(const struct ctlra_dev_t *dev,
+			 struct ctlra_dev_state_t *state);
+
 /** Get the human readable name for *control_id* from *dev*. The
  * control id is passed in eg: event.button.id, or can be any of the
  * DEVICE_NAME_CONTROLS enumeration. Ownership of the string *remains* in
@@ -216,6 +275,9 @@ struct ctlra_dev_info_t {
 	 * The use-case for this runtime-constant ID number is to allow an
 	 * application to easily detect when a controller is "returning",
 	 * or when a new controller is being plugged in.
+	 *
+	 * Devices with neither a serial nor a USB port, such as MIDI and
+	 * virtual devices, can't be recognised and have a unique_id of 0.
 	 */
 	uint32_t unique_id;
 
@@ -335,6 +397,34 @@ void ctlra_dev_set_remove_func(struct ctlra_dev_t *dev,
  */
 void ctlra_idle_iter(struct ctlra_t *ctlra);
 
+/** Fill *fds* with the file descriptors that an application with its
+ * own main loop waits on, with poll() or epoll. When any is readable, or
+ * ctlra_get_timeout() expires, the application calls ctlra_idle_iter().
+ * The fds are those of libusb, of MIDI devices, and an eventfd that ctlra
+ * signals when it has work outside of those, such as queued hotplug
+ * events. The set changes when devices are added or removed, so fetch it
+ * again after each ctlra_idle_iter().
+ * @retval The number of fds, of which at most *max* are written
+ */
+struct pollfd;
+int32_t ctlra_get_pollfds(struct ctlra_t *ctlra, struct pollfd *fds,
+			  uint32_t max);
+
+/** Milliseconds until ctlra_idle_iter() must be called even without fd
+ * activity, to expire USB transfers, call feedback functions, and redraw
+ * screens. Returns -1 if there is no such deadline */
+int32_t ctlra_get_timeout(struct ctlra_t *ctlra);
+
+/** When *ctlra* runs an I/O thread (see ctlra_create_opts_t), it does the
+ * work of ctlra_idle_iter() itself, and ctlra_idle_iter() returns
+ * immediately. The application must hold this lock when it calls any
+ * other ctlra function on the context or its devices from its own
+ * threads. Callbacks are already called with the lock held, so it must
+ * not be taken from inside a callback. Without an I/O thread these
+ * functions do nothing */
+void ctlra_io_lock(struct ctlra_t *ctlra);
+void ctlra_io_unlock(struct ctlra_t *ctlra);
+
 /** Cleanup any resources allocated internally in Ctlra. This function
  * releases all resources attached to this context, but does NOT interfere
  * with other ctlra instances */
@@ -406,21 +496,118 @@ void ctlra_strerror(struct ctlra_t *ctlra, FILE* out);
 void ctlra_dev_set_event_func(struct ctlra_dev_t* dev,
 			      ctlra_event_func event_func);
 
+/** Set an event func that receives the events as a contiguous array,
+ * instead of an array of pointers. When set, it is called instead of the
+ * event func set by *ctlra_dev_set_event_func*. Pass NULL to return to
+ * the pointer based event func.
+ */
+void ctlra_dev_set_event_array_func(struct ctlra_dev_t* dev,
+				    ctlra_event_array_func func);
+
+/** Also write the events of the device into *ring*, see
+ * *ctlra_event_ring_t*. The event funcs are still called as usual. A ring
+ * may be shared by devices of the same *ctlra_t*. Pass NULL to detach.
+ */
+void ctlra_dev_set_event_ring(struct ctlra_dev_t* dev,
+			      struct ctlra_event_ring_t *ring);
+
+/** Subscribe to part of the events of *dev*. Only event types with their
+ * CTLRA_EVENT_MASK() bit set in *type_mask* are delivered, and if *ids*
+ * is not NULL, only the controls selected in it. Drivers skip decoding
+ * controls that are not subscribed, so a report is cheaper to handle the
+ * fewer controls the application uses. By default, and after passing
+ * CTLRA_EVENT_MASK_ALL and NULL, all events are delivered.
+ */
+void ctlra_dev_set_event_mask(struct ctlra_dev_t *dev, uint32_t type_mask,
+			      const struct ctlra_event_ids_t *ids);
+
+/** Coalesce continuous controls of the device when *enable* is non-zero.
+ * Events of one ctlra_idle_iter() are then delivered together, with
+ * slider events of the same id merged into one carrying the latest
+ * value, and encoder deltas of the same id summed. Buttons and grid
+ * events are never merged. The number of merged events is printed at
+ * disconnect with CTLRA_DEBUG_INFO. Off by default.
+ */
+void ctlra_dev_set_coalesce(struct ctlra_dev_t* dev, uint8_t enable);
+
 /** Write Lights/LEDs feedback to device. See *ctlra_dev_lights_flush* to
  * flush the actual bytes over the cable to the device.
  * The *light_id* is a value specific to the device that enumerates each
  * available light. The *light_status* variable represents the state of
  * the light, as a bitmask of 3 properties: blinking, brightness, colour.
- * The top bit (1 << 31) indicates if the light should be blinking.
+ * The top bit (1 << 31) indicates if the light should be blinking, which
+ * starts a *CTLRA_LIGHT_ANIM_BLINK* of *CTLRA_LIGHT_BLINK_MS* on it.
  * The brightness (0x7F << 24) is a 0 to 127 brightness value.
  * The remaining 16 bits are encoded as 0xRRGGBB in hex.
  * Controllers should support these inputs as best they can for the given
  * light_id.
+ * Ctlra keeps the last status set for each light, so setting a light to
+ * the status it already has does not reach the driver. Setting a light
+ * stops any animation on it.
  */
 void ctlra_dev_light_set(struct ctlra_dev_t *dev,
 			uint32_t light_id,
 			uint32_t light_status);
 
+/** Light animations, run by Ctlra in ctlra_idle_iter() or the I/O thread
+ * so that the application doesn't have to resend lights every frame */
+enum ctlra_light_anim_type_t {
+	/* stop animating, the light keeps its current state */
+	CTLRA_LIGHT_ANIM_NONE = 0,
+	/* the status for the first half of each period, off for the rest */
+	CTLRA_LIGHT_ANIM_BLINK,
+	/* full brightness at the start of each period, off halfway */
+	CTLRA_LIGHT_ANIM_PULSE,
+	/* from the status brightness to off over one period, then stop */
+	CTLRA_LIGHT_ANIM_FADE,
+};
+
+/** Period of the blink started by bit 31 of a light status */
+#define CTLRA_LIGHT_BLINK_MS 500
+/** Rate at which animated lights are updated and flushed */
+#define CTLRA_LIGHT_ANIM_MS 20
+
+/** Animate *light_id* with *light_status* as the base state. Periodic
+ * animations are aligned to the time set with ctlra_dev_lights_anim_sync(),
+ * offset by *phase* periods (0 to 1). Only changes in the animated state
+ * reach the driver, and they are flushed by Ctlra.
+ * Returns 0 on success, -EINVAL for a light_id that can't be animated or
+ * a zero period, and -ENOMEM if the animation table can't be allocated.
+ */
+int32_t ctlra_dev_light_animate(struct ctlra_dev_t *dev,
+				uint32_t light_id,
+				uint32_t light_status,
+				enum ctlra_light_anim_type_t type,
+				uint32_t period_ms,
+				float phase);
+
+/** Animate *count* consecutive lights from *first_id*, each with its
+ * entry of *status* as base state, see ctlra_dev_light_animate(). */
+int32_t ctlra_dev_lights_animate_range(struct ctlra_dev_t *dev,
+				       uint32_t first_id,
+				       uint32_t count,
+				       const uint32_t *status,
+				       enum ctlra_light_anim_type_t type,
+				       uint32_t period_ms,
+				       float phase);
+
+/** Align periodic animations to *time_ns*, a CLOCK_MONOTONIC time as
+ * used by *ctlra_event_t::timestamp*, or now if zero. To sync to a tempo,
+ * pass the time of a beat and use the beat length as period. */
+void ctlra_dev_lights_anim_sync(struct ctlra_dev_t *dev, uint64_t time_ns);
+
+/** Set *count* consecutive lights starting at *first_id* from the
+ * *status* array, each encoded as for *ctlra_dev_light_set*. Lights whose
+ * status did not change are skipped, and the remaining span is handed to
+ * the driver in a single call where the driver supports it. As with
+ * *ctlra_dev_light_set*, animations on these lights stop and bit 31
+ * starts a blink.
+ */
+void ctlra_dev_lights_set_range(struct ctlra_dev_t *dev,
+				uint32_t first_id,
+				uint32_t count,
+				const uint32_t *status);
+
 /** Feedback item set: sets the value for a feedback item */
 void ctlra_dev_feedback_set(struct ctlra_dev_t *dev,
 			    uint32_t fb_id,
@@ -434,6 +621,8 @@ void ctlra_dev_feedback_digits(struct ctlra_dev_t *dev,
 /** Flush the bytes with the Lights/LEDs info over the cable. The device
  * implementation must track which lights are actually dirty, and only
  * flush the bytes needed. If *force* is set, force flush everything.
+ * Without *force*, the flush is skipped when no light, grid light or
+ * feedback item changed since the last flush.
  */
 void ctlra_dev_light_flush(struct ctlra_dev_t *dev, uint32_t force);
 
@@ -447,6 +636,16 @@ void ctlra_dev_grid_light_set(struct ctlra_dev_t *dev,
 			     uint32_t light_id,
 			     uint32_t light_status);
 
+/** Set a whole frame of grid lights in one call: *status* holds *count*
+ * entries in grid position order, encoded as for *ctlra_dev_light_set*.
+ * Drivers without a native frame update get one
+ * *ctlra_dev_grid_light_set* per position.
+ */
+void ctlra_dev_grid_lights_set_frame(struct ctlra_dev_t *dev,
+				     uint32_t grid_id,
+				     uint32_t count,
+				     const uint32_t *status);
+
 /** @warning
  * @b DEPRECATED: this API has been superseeded, use the screen update
  * callback APIs instead.
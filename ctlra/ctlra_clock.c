@@ -0,0 +1,84 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "ctlra_clock.h"
+
+/* The loop follows "Using a DLL to filter time", F. Adriaensen, 2005.
+ * t0 and t1 are the filtered start times of the current and the next
+ * period, e2 the filtered period duration */
+
+/* If the measured period start is this many periods off the estimate
+ * (eg after an xrun), the loop restarts instead of slowly converging */
+#define CTLRA_CLOCK_RESET_PERIODS 4
+
+static void ctlra_clock_start(struct ctlra_clock_t *clock, uint64_t time_ns,
+			      uint32_t nframes)
+{
+	double tper = nframes / (double)clock->sample_rate;
+	double omega = 2 * M_PI * clock->bandwidth * tper;
+
+	clock->b = sqrt(2) * omega;
+	clock->c = omega * omega;
+	clock->base_ns = time_ns;
+	clock->nframes = nframes;
+	clock->e2 = tper;
+	clock->t0 = 0;
+	clock->t1 = tper;
+	clock->running = 1;
+}
+
+void ctlra_clock_init(struct ctlra_clock_t *clock, uint32_t sample_rate,
+		      float bandwidth_hz)
+{
+	memset(clock, 0, sizeof(*clock));
+	clock->sample_rate = sample_rate ? sample_rate : 48000;
+	clock->bandwidth = bandwidth_hz > 0 ? bandwidth_hz : 1.f;
+}
+
+void ctlra_clock_period(struct ctlra_clock_t *clock, uint64_t time_ns,
+			uint32_t nframes)
+{
+	if(!time_ns) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		time_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
+
+	/* the coefficients depend on the period size */
+	if(!clock->running || nframes != clock->nframes) {
+		ctlra_clock_start(clock, time_ns, nframes);
+		return;
+	}
+
+	double t = (int64_t)(time_ns - clock->base_ns) * 1e-9;
+	double e = t - clock->t1;
+	if(fabs(e) > clock->e2 * CTLRA_CLOCK_RESET_PERIODS) {
+		ctlra_clock_start(clock, time_ns, nframes);
+		return;
+	}
+
+	clock->t0 = clock->t1;
+	clock->t1 += clock->b * e + clock->e2;
+	clock->e2 += clock->c * e;
+}
+
+uint32_t ctlra_clock_frame_offset(const struct ctlra_clock_t *clock,
+				  uint64_t timestamp)
+{
+	if(!clock->running)
+		return 0;
+
+	/* an event that arrived during the previous period plays at the
+	 * same relative position in this one */
+	double period = clock->t1 - clock->t0;
+	double t = (int64_t)(timestamp - clock->base_ns) * 1e-9;
+	double pos = (t - (clock->t0 - period)) / period;
+
+	if(pos <= 0)
+		return 0;
+	uint32_t frame = pos * clock->nframes;
+	if(frame >= clock->nframes)
+		frame = clock->nframes - 1;
+	return frame;
+}
@@ -0,0 +1,67 @@
+/* Public header for mapping event timestamps to audio frame positions.
+ */
+#ifndef CTLRA_CLOCK
+#define CTLRA_CLOCK
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @file
+ * Ctlra events carry the CLOCK_MONOTONIC time at which they arrived, see
+ * *ctlra_event_t::timestamp*. To play an event at the right time, an
+ * audio engine must know where that time falls in its own period clock.
+ *
+ * The *ctlra_clock_t* keeps a delay-locked loop estimate of when each
+ * audio period starts, fed once per period from the process callback.
+ * Events that arrived during the previous period are then placed at the
+ * matching frame of the current period: a constant latency of one
+ * period, with the timing between events preserved.
+ *
+ * All functions must be called from the same thread, normally the audio
+ * process callback. None of them block, allocate or make syscalls, except
+ * *ctlra_clock_period* when passed a time of zero (clock_gettime).
+ */
+
+/** Clock state. Allocate it anywhere (static, stack, heap), and call
+ * *ctlra_clock_init* before use. The fields are private. */
+struct ctlra_clock_t {
+	uint32_t sample_rate;
+	uint32_t nframes;
+	uint32_t running;
+	float bandwidth;
+	/* all times in seconds, relative to base_ns */
+	uint64_t base_ns;
+	double t0;
+	double t1;
+	double e2;
+	/* loop filter coefficients */
+	double b;
+	double c;
+};
+
+/** Initialize the clock for *sample_rate*. The loop bandwidth defaults
+ * to 1 Hz when *bandwidth_hz* is zero or negative */
+void ctlra_clock_init(struct ctlra_clock_t *clock, uint32_t sample_rate,
+		      float bandwidth_hz);
+
+/** Feed the start of a period of *nframes* frames to the clock. Call at
+ * the start of each process callback, with the CLOCK_MONOTONIC time in
+ * nanoseconds at which the period started, or 0 to read the clock now */
+void ctlra_clock_period(struct ctlra_clock_t *clock, uint64_t time_ns,
+			uint32_t nframes);
+
+/** Returns the frame in the current period at which an event with
+ * *timestamp* (nanoseconds, CLOCK_MONOTONIC) should take effect. The
+ * result is clamped to the range 0 to nframes - 1, so events that are
+ * older or newer than expected are played at the period edges */
+uint32_t ctlra_clock_frame_offset(const struct ctlra_clock_t *clock,
+				  uint64_t timestamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
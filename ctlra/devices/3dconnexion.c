@@ -140,18 +140,6 @@ spacemouse_control_get_name(enum ctlra_event_type_t type,
 	return 0;
 }
 
-static uint32_t
-spacemouse_poll(struct ctlra_dev_t *base)
-{
-	struct spacemouse_t *dev = (struct spacemouse_t *)base;
-#define BUF_SIZE 32
-	uint8_t buf[BUF_SIZE];
-	ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-					  USB_ENDPOINT_READ, buf,
-					  BUF_SIZE);
-	return 0;
-}
-
 void
 spacemouse_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 		       uint8_t *data, uint32_t size)
@@ -175,8 +163,7 @@ spacemouse_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				},
 			};
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 		break;
 	case DOF_MSG_SIZE:
@@ -198,8 +185,7 @@ spacemouse_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 					.value = v / 350.f},
 			};
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 		break;
 	default: break;
@@ -240,7 +226,6 @@ struct ctlra_dev_t *
 ctlra_spacemouse_connect(ctlra_event_func event_func, void *userdata,
 			    void *future)
 {
-	(void)future;
 	struct spacemouse_t *dev = calloc(1, sizeof(struct spacemouse_t));
 	if(!dev)
 		goto fail;
@@ -251,7 +236,8 @@ ctlra_spacemouse_connect(ctlra_event_func event_func, void *userdata,
 
 	int err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err)
 		goto fail;
 
@@ -259,10 +245,9 @@ ctlra_spacemouse_connect(ctlra_event_func event_func, void *userdata,
 						USB_INTERFACE_ID,
 						USB_HANDLE_IDX);
 	if(err)
-		goto fail;
+		goto fail_close;
 
 	dev->base.info = ctlra_spacemouse_info;
-	dev->base.poll = spacemouse_poll;
 	dev->base.disconnect = spacemouse_disconnect;
 	dev->base.light_set = spacemouse_light_set;
 	dev->base.light_flush = spacemouse_light_flush;
@@ -271,7 +256,17 @@ ctlra_spacemouse_connect(ctlra_event_func event_func, void *userdata,
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 32,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
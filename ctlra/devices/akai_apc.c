@@ -63,9 +63,17 @@ static uint32_t akai_apc_poll(struct ctlra_dev_t *base)
 	return 0;
 }
 
+static int32_t akai_apc_get_pollfds(struct ctlra_dev_t *base,
+				    struct pollfd *fds, uint32_t max)
+{
+	struct akai_apc_t *dev = (struct akai_apc_t *)base;
+	return ctlra_midi_get_pollfds(dev->midi, fds, max);
+}
+
 int akai_apc_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 {
 	struct akai_apc_t *dev = (struct akai_apc_t *)ud;
+	dev->base.event_timestamp = ctlra_impl_time_ns();
 
 	switch(buf[0] & 0xf0) {
 	case 0xb0:
@@ -79,8 +87,7 @@ int akai_apc_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 				},
 			};
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 			}
 			break;
 		case 0xf: /* master volume */
@@ -146,6 +153,7 @@ akai_apc_connect(ctlra_event_func event_func,
 	dev->base.info.device_id = APC40;
 
 	dev->base.poll = akai_apc_poll;
+	dev->base.get_pollfds = akai_apc_get_pollfds;
 	dev->base.disconnect = akai_apc_disconnect;
 	dev->base.light_set = akai_apc_light_set;
 	//dev->base.control_get_name = akai_apc_control_get_name;
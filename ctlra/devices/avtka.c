@@ -182,8 +182,7 @@ event_cb(struct avtka_t *avtka, uint32_t item, float value, void *userdata)
 
 	/* send event */
 	struct ctlra_event_t *e = {&event};
-	dev->base.event_func(&dev->base, 1, &e,
-			     dev->base.event_func_userdata);
+	ctlra_dev_impl_event_add(&dev->base, e);
 }
 
 void
@@ -91,8 +91,7 @@ firmata_poll(struct ctlra_dev_t *base)
 				}
 			};
 			struct ctlra_event_t *e = {&events};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 			dev->hw_values[i] = pressed;
 		}
 	}
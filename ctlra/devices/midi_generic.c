@@ -61,10 +61,19 @@ midi_generic_poll(struct ctlra_dev_t *base)
 	return 0;
 }
 
+static int32_t
+midi_generic_get_pollfds(struct ctlra_dev_t *base, struct pollfd *fds,
+			 uint32_t max)
+{
+	struct midi_generic_t *dev = (struct midi_generic_t *)base;
+	return ctlra_midi_get_pollfds(dev->midi, fds, max);
+}
+
 int
 midi_generic_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 {
 	struct midi_generic_t *dev = (struct midi_generic_t *)ud;
+	dev->base.event_timestamp = ctlra_impl_time_ns();
 
 	switch(buf[0] & 0xf0) {
 	case 0x90: /* Note On */
@@ -79,8 +88,7 @@ midi_generic_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 			},
 		};
 		struct ctlra_event_t *e = {&event};
-		dev->base.event_func(&dev->base, 1, &e,
-				     dev->base.event_func_userdata);
+		ctlra_dev_impl_event_add(&dev->base, e);
 		} break;
 
 	case 0xb0: /* control change */ {
@@ -92,8 +100,7 @@ midi_generic_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 			},
 		};
 		struct ctlra_event_t *e = {&event};
-		dev->base.event_func(&dev->base, 1, &e,
-				     dev->base.event_func_userdata);
+		ctlra_dev_impl_event_add(&dev->base, e);
 		}
 		break;
 	};
@@ -170,6 +177,7 @@ ctlra_midi_generic_connect(ctlra_event_func event_func, void *userdata,
 	dev->base.info = ctlra_midi_generic_info;
 
 	dev->base.poll = midi_generic_poll;
+	dev->base.get_pollfds = midi_generic_get_pollfds;
 	dev->base.disconnect = midi_generic_disconnect;
 	dev->base.light_set = midi_generic_light_set;
 	dev->base.light_flush = midi_generic_light_flush;
@@ -306,7 +306,8 @@ struct ni_kontrol_d2_t {
 
 	/* this is a huge datastructure that includes full frame pixels,
 	 * leave it at the end of the struct to get out of the way */
-	struct d2_screen_blit screen_blit;
+	/* double buffered, each holds a struct d2_screen_blit */
+	struct ctlra_usb_fb_t screen;
 };
 
 static const char *
@@ -337,19 +338,6 @@ ni_kontrol_d2_control_get_name(enum ctlra_event_type_t type,
 	return ret;
 }
 
-static uint32_t ni_kontrol_d2_poll(struct ctlra_dev_t *base)
-{
-	struct ni_kontrol_d2_t *dev = (struct ni_kontrol_d2_t *)base;
-#define BUF_SIZE 1024
-	uint8_t buf[BUF_SIZE];
-	int handle_idx = 0;
-
-	ctlra_dev_impl_usb_interrupt_read(base, handle_idx,
-					  USB_ENDPOINT_BTNS_READ,
-					  buf, BUF_SIZE);
-	return 0;
-}
-
 void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				uint8_t *data, uint32_t size)
 {
@@ -374,8 +362,7 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 					}
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 				//printf("encoder %d: value = %f\n", i, event.encoder.delta_float);
 				dev->screen_encoders[i] = val;
 			}
@@ -394,8 +381,7 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 					},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 		break;
@@ -419,8 +405,7 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 					},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 		/* Browse / Loop Encoders */
@@ -441,8 +426,7 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 							    dev->encoder_browse);
 			event.encoder.delta = dir;
 			dev->encoder_browse = browse;
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 		/* Loop encoder turn event */
 		if(loop != dev->encoder_loop) {
@@ -451,8 +435,7 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			event.encoder.id = NI_KONTROL_D2_ENCODER_LOOP;
 			event.encoder.delta = dir;
 			dev->encoder_loop = loop;
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 
 		/* Touchstrip */
@@ -467,8 +450,7 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				},
 			};
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 		/* Send touchstrip updates after button detection */
 		if(dev->touchstrip_touch) {
@@ -480,8 +462,7 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				},
 			};
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 		break;
 	} /* case 17 */
@@ -492,16 +473,16 @@ uint8_t *
 ni_kontrol_d2_screen_get_pixels(struct ctlra_dev_t *base)
 {
 	struct ni_kontrol_d2_t *dev = (struct ni_kontrol_d2_t *)base;
-	return (uint8_t *)&dev->screen_blit.pixels;
+	struct d2_screen_blit *blit = (struct d2_screen_blit *)
+		ctlra_dev_impl_usb_fb_back(&dev->screen);
+	return blit->pixels;
 }
 
 static void
 ni_kontrol_d2_screen_splash(struct ctlra_dev_t *base)
 {
-	struct ni_kontrol_d2_t *dev = (struct ni_kontrol_d2_t *)base;
-	memset(dev->screen_blit.pixels, 0x0,
-	       sizeof(dev->screen_blit.pixels));
-	ni_kontrol_d2_screen_blit(&dev->base);
+	memset(ni_kontrol_d2_screen_get_pixels(base), 0x0, NUM_PX * 2);
+	ni_kontrol_d2_screen_blit(base);
 }
 
 void
@@ -509,10 +490,7 @@ ni_kontrol_d2_screen_blit(struct ctlra_dev_t *base)
 {
 	struct ni_kontrol_d2_t *dev = (struct ni_kontrol_d2_t *)base;
 
-	int ret = ctlra_dev_impl_usb_bulk_write(base, USB_INTERFACE_SCREEN,
-						USB_ENDPOINT_SCREEN_WRITE,
-						(uint8_t *)&dev->screen_blit,
-						sizeof(dev->screen_blit));
+	int ret = ctlra_dev_impl_usb_fb_flush(&dev->screen);
 	if(ret < 0)
 		printf("%s write failed!\n", __func__);
 }
@@ -528,7 +506,7 @@ ni_kontrol_d2_screen_get_data(struct ctlra_dev_t *base,
 	struct ni_kontrol_d2_t *dev = (struct ni_kontrol_d2_t *)base;
 	/* fill in out params */
 	*pixels = ni_kontrol_d2_screen_get_pixels(base);
-	*bytes = sizeof(dev->screen_blit.pixels);
+	*bytes = NUM_PX * 2;
 
 	if(flush)
 		ni_kontrol_d2_screen_blit(base);
@@ -707,7 +685,6 @@ struct ctlra_dev_t *
 ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
                       void *userdata, void *future)
 {
-	(void)future;
 	struct ni_kontrol_d2_t *dev = calloc(1, sizeof(struct ni_kontrol_d2_t));
 	if(!dev)
 		goto fail;
@@ -719,7 +696,8 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 
 	/* Open buttons / leds handle */
 	int err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err) {
 		//printf("%s: failed to open button usb interface\n", __func__);
 		goto fail;
@@ -730,7 +708,7 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 	                                        USB_INTERFACE_BTNS);
 	if(err) {
 		//printf("%s: failed to open button usb interface\n", __func__);
-		goto fail;
+		goto fail_close;
 	}
 
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
@@ -738,7 +716,7 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 	                                        USB_INTERFACE_SCREEN);
 	if(err) {
 		//printf("%s: failed to open screen usb interface\n", __func__);
-		goto fail;
+		goto fail_close;
 	}
 
 	/* TODO: copy info from static info below */
@@ -747,12 +725,21 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 	dev->base.info.control_count[CTLRA_EVENT_ENCODER] = ENCODER_SIZE;
 	dev->base.info.get_name = ni_kontrol_d2_control_get_name;
 
-	/* Copy the screen update details into the embedded struct */
-	memcpy(dev->screen_blit.header , header , sizeof(dev->screen_blit.header));
-	memcpy(dev->screen_blit.command, command, sizeof(dev->screen_blit.command));
-	memcpy(dev->screen_blit.footer , footer , sizeof(dev->screen_blit.footer));
+	/* Copy the screen update details into both framebuffers */
+	err = ctlra_dev_impl_usb_fb_init(&dev->base, &dev->screen,
+					 USB_INTERFACE_SCREEN,
+					 USB_ENDPOINT_SCREEN_WRITE,
+					 sizeof(struct d2_screen_blit));
+	if(err)
+		goto fail_close;
+	for(int i = 0; i < 2; i++) {
+		struct d2_screen_blit *blit =
+			(struct d2_screen_blit *)dev->screen.buf[i];
+		memcpy(blit->header , header , sizeof(blit->header));
+		memcpy(blit->command, command, sizeof(blit->command));
+		memcpy(blit->footer , footer , sizeof(blit->footer));
+	}
 
-	dev->base.poll = ni_kontrol_d2_poll;
 	dev->base.disconnect = ni_kontrol_d2_disconnect;
 	dev->base.light_set = ni_kontrol_d2_light_set;
 	dev->base.light_flush = ni_kontrol_d2_light_flush;
@@ -762,7 +749,17 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_INTERFACE_BTNS,
+							 USB_ENDPOINT_BTNS_READ,
+							 1024,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
@@ -204,7 +204,9 @@ void ni_kontrol_d2_light_touchstrip(struct ctlra_dev_t *dev,
  */
 uint8_t *ni_kontrol_d2_screen_get_pixels(struct ctlra_dev_t *base);
 
-/* Blit data to the screen. */
+/* Blit data to the screen. The pixels are sent without a copy, so after
+ * a blit the pointer from ni_kontrol_d2_screen_get_pixels() is stale: get
+ * it again, and redraw the whole frame into it. */
 void ni_kontrol_d2_screen_blit(struct ctlra_dev_t *base);
 
 #endif /* OPENAV_CTLRA_NI_KONTROL_D2_H */
@@ -193,17 +193,6 @@ ni_kontrol_f1_control_get_name(enum ctlra_event_type_t type,
 	return 0;
 }
 
-static uint32_t ni_kontrol_f1_poll(struct ctlra_dev_t *base)
-{
-	struct ni_kontrol_f1_t *dev = (struct ni_kontrol_f1_t *)base;
-#define BUF_SIZE 1024
-	uint8_t buf[BUF_SIZE];
-
-	ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-					  USB_ENDPOINT_READ, buf, BUF_SIZE);
-	return 0;
-}
-
 
 void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				uint8_t *data, uint32_t size)
@@ -228,8 +217,7 @@ void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.value = v / 4096.f},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 
@@ -249,8 +237,7 @@ void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			};
 			event.encoder.delta = dir;
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 
 		/* Grid */
@@ -258,11 +245,13 @@ void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
 			0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
 		};
+		uint64_t pressed = 0;
 		for(uint32_t i = 0; i < GRID_SIZE; i++) {
 			int offset = 1 + i / 8;
 			int mask   = grid_masks[i];
 
 			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
+			pressed |= (uint64_t)(v != 0) << i;
 			int value_idx = SLIDERS_SIZE + BUTTONS_SIZE + i;
 			if(dev->hw_values[value_idx] != v) {
 				dev->hw_values[value_idx] = v;
@@ -276,11 +265,12 @@ void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 					},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 
+		ctlra_dev_impl_grid_snapshot(&dev->base, 0, GRID_SIZE, pressed, 0);
+
 		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
 			int id     = buttons[i].event_id;
 			int offset = buttons[i].buf_byte_offset;
@@ -299,8 +289,7 @@ void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.pressed = v > 0},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 		break;
@@ -399,28 +388,25 @@ struct ctlra_dev_t *
 ctlra_ni_kontrol_f1_connect(ctlra_event_func event_func, void *userdata,
 			    void *future)
 {
-	(void)future;
 	struct ni_kontrol_f1_t *dev = calloc(1, sizeof(struct ni_kontrol_f1_t));
 	if(!dev)
 		goto fail;
 
 	int err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err) {
 		free(dev);
 		return 0;
 	}
 
 	err = ctlra_dev_impl_usb_open_interface(&dev->base, USB_INTERFACE_ID, USB_HANDLE_IDX);
-	if(err) {
-		free(dev);
-		return 0;
-	}
+	if(err)
+		goto fail_close;
 
 	dev->base.info = ctlra_ni_kontrol_f1_info;
 
-	dev->base.poll = ni_kontrol_f1_poll;
 	dev->base.disconnect = ni_kontrol_f1_disconnect;
 	dev->base.light_set = ni_kontrol_f1_light_set;
 	dev->base.light_flush = ni_kontrol_f1_light_flush;
@@ -429,7 +415,17 @@ ctlra_ni_kontrol_f1_connect(ctlra_event_func event_func, void *userdata,
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 1024,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
@@ -426,19 +426,6 @@ ni_kontrol_s2_mk2_control_get_name(enum ctlra_event_type_t type,
 	return 0;
 }
 
-static uint32_t ni_kontrol_s2_mk2_poll(struct ctlra_dev_t *base)
-{
-	struct ni_kontrol_s2_mk2_t *dev = (struct ni_kontrol_s2_mk2_t *)base;
-#define BUF_SIZE 1024
-	uint8_t buf[BUF_SIZE];
-
-	int handle_idx = 0;
-	ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-					  USB_ENDPOINT_READ,
-					  buf, BUF_SIZE);
-	return 0;
-}
-
 void ni_kontrol_s2_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				uint8_t *data, uint32_t size)
 {
@@ -485,8 +472,7 @@ void ni_kontrol_s2_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 					}
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 
@@ -508,8 +494,7 @@ void ni_kontrol_s2_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.pressed = v > 0},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 		} break;
@@ -536,8 +521,7 @@ void ni_kontrol_s2_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 
 			if(v != dev->encoder_values[i]) {
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 				dev->encoder_values[i] = v;
 			}
 		}
@@ -557,8 +541,7 @@ void ni_kontrol_s2_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.value = v / 4096.f},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 		break;
@@ -649,7 +632,6 @@ struct ctlra_dev_t *
 ctlra_ni_kontrol_s2_mk2_connect(ctlra_event_func event_func,
 				  void *userdata, void *future)
 {
-	(void)future;
 	struct ni_kontrol_s2_mk2_t *dev =
 		calloc(1, sizeof(struct ni_kontrol_s2_mk2_t));
 	if(!dev)
@@ -659,7 +641,8 @@ ctlra_ni_kontrol_s2_mk2_connect(ctlra_event_func event_func,
 
 	int err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err) {
 		free(dev);
 		return 0;
@@ -667,12 +650,9 @@ ctlra_ni_kontrol_s2_mk2_connect(ctlra_event_func event_func,
 
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
-	if(err) {
-		free(dev);
-		return 0;
-	}
+	if(err)
+		goto fail_close;
 
-	dev->base.poll = ni_kontrol_s2_mk2_poll;
 	dev->base.disconnect = ni_kontrol_s2_mk2_disconnect;
 	dev->base.light_set = ni_kontrol_s2_mk2_light_set;
 	dev->base.light_flush = ni_kontrol_s2_mk2_light_flush;
@@ -681,7 +661,17 @@ ctlra_ni_kontrol_s2_mk2_connect(ctlra_event_func event_func,
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 1024,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
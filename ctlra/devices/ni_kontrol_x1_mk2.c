@@ -334,19 +334,6 @@ ni_kontrol_x1_mk2_control_get_name(enum ctlra_event_type_t type,
 	return name_by_type[type][control];
 }
 
-static uint32_t
-ni_kontrol_x1_mk2_poll(struct ctlra_dev_t *base)
-{
-	struct ni_kontrol_x1_mk2_t *dev = (struct ni_kontrol_x1_mk2_t *)base;
-	uint8_t buf[1024];
-
-	/* calls into usb_read_cb below if data is available */
-	ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-					  USB_ENDPOINT_READ, buf, 1024);
-
-	return 0;
-}
-
 void ni_kontrol_x1_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				uint8_t *data, uint32_t size)
 {
@@ -369,8 +356,7 @@ void ni_kontrol_x1_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.value = v / 4096.f},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 
@@ -394,8 +380,7 @@ void ni_kontrol_x1_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				event.encoder.delta = dir;
 				event.encoder.id =
 					NI_KONTROL_X1_MK2_BTN_ENCODER_MID_ROTATE + i;
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 				/* update cached value */
 				dev->encoder_values[i] = enc[i];
 			}
@@ -419,8 +404,7 @@ void ni_kontrol_x1_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.pressed = v > 0},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 
@@ -437,8 +421,7 @@ void ni_kontrol_x1_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 		 * happens frequently while just slideing, so no event
 		 * is sent when 0 is the value. */
 		if(dev->touchstrip_value != v && v != 0) {
-			dev->base.event_func(&dev->base, 1, &te2,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, te2);
 			dev->touchstrip_value = v;
 		}
 
@@ -602,14 +585,14 @@ struct ctlra_dev_t *
 ctlra_ni_kontrol_x1_mk2_connect(ctlra_event_func event_func,
 				void *userdata, void *future)
 {
-	(void)future;
 	struct ni_kontrol_x1_mk2_t *dev =
 		calloc(1, sizeof(struct ni_kontrol_x1_mk2_t));
 	if(!dev)
 		return 0;
 
 	int err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err) {
 		free(dev);
 		return 0;
@@ -618,14 +601,11 @@ ctlra_ni_kontrol_x1_mk2_connect(ctlra_event_func event_func,
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 						USB_INTERFACE_ID,
 						USB_HANDLE_IDX);
-	if(err) {
-		free(dev);
-		return 0;
-	}
+	if(err)
+		goto fail_close;
 
 	dev->base.info = ctlra_ni_kontrol_x1_mk2_info;
 
-	dev->base.poll = ni_kontrol_x1_mk2_poll;
 	dev->base.disconnect = ni_kontrol_x1_mk2_disconnect;
 	dev->base.light_set = ni_kontrol_x1_mk2_light_set;
 	dev->base.light_flush = ni_kontrol_x1_mk2_light_flush;
@@ -646,7 +626,19 @@ ctlra_ni_kontrol_x1_mk2_connect(ctlra_event_func event_func,
 		dev->lights_81[j+1] = 0x0; /* blue */
 	}
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 1024,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
+	free(dev);
+	return 0;
 }
 
 struct ctlra_dev_info_t ctlra_ni_kontrol_x1_mk2_info = {
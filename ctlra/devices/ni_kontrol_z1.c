@@ -200,19 +200,6 @@ ni_kontrol_z1_control_get_name(enum ctlra_event_type_t type,
 	return 0;
 }
 
-static uint32_t
-ni_kontrol_z1_poll(struct ctlra_dev_t *base)
-{
-	struct ni_kontrol_z1_t *dev = (struct ni_kontrol_z1_t *)base;
-#define BUF_SIZE 1024
-	uint8_t buf[BUF_SIZE];
-
-	ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-					  USB_ENDPOINT_READ,
-					  buf, BUF_SIZE);
-	return 0;
-}
-
 /* TODO: remove forward declarations */
 static void ni_kontrol_z1_light_set(struct ctlra_dev_t *base,
 				    uint32_t light_id,
@@ -228,8 +215,16 @@ void ni_kontrol_z1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 	uint8_t *buf = data;
 	switch(size) {
 	case 30: {
-		for(uint32_t i = 0; i < SLIDERS_SIZE; i++) {
+		/* controls the app didn't subscribe to are not decoded */
+		const int want_sliders =
+			ctlra_dev_impl_event_type_wanted(base, CTLRA_EVENT_SLIDER);
+		const int want_buttons =
+			ctlra_dev_impl_event_type_wanted(base, CTLRA_EVENT_BUTTON);
+
+		for(uint32_t i = 0; want_sliders && i < SLIDERS_SIZE; i++) {
 			int id     = i;
+			if(!ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_SLIDER, id))
+				continue;
 			int offset = sliders[i].buf_byte_offset;
 			int mask   = sliders[i].mask;
 
@@ -243,12 +238,13 @@ void ni_kontrol_z1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.value = v / 4096.f},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
+		for(uint32_t i = 0; want_buttons && i < BUTTONS_SIZE; i++) {
 			int id     = i;
+			if(!ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_BUTTON, id))
+				continue;
 			int offset = buttons[i].buf_byte_offset;
 			int mask   = buttons[i].mask;
 
@@ -265,8 +261,7 @@ void ni_kontrol_z1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.pressed = v > 0},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 		break;
@@ -356,7 +351,6 @@ struct ctlra_dev_t *
 ctlra_ni_kontrol_z1_connect(ctlra_event_func event_func,
 				  void *userdata, void *future)
 {
-	(void)future;
 	struct ni_kontrol_z1_t *dev = calloc(1, sizeof(struct ni_kontrol_z1_t));
 	if(!dev)
 		goto fail;
@@ -365,7 +359,8 @@ ctlra_ni_kontrol_z1_connect(ctlra_event_func event_func,
 
 	int err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err) {
 		free(dev);
 		return 0;
@@ -373,12 +368,9 @@ ctlra_ni_kontrol_z1_connect(ctlra_event_func event_func,
 
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
-	if(err) {
-		free(dev);
-		return 0;
-	}
+	if(err)
+		goto fail_close;
 
-	dev->base.poll = ni_kontrol_z1_poll;
 	dev->base.disconnect = ni_kontrol_z1_disconnect;
 	dev->base.light_set = ni_kontrol_z1_light_set;
 	dev->base.feedback_set = ni_kontrol_z1_feedback_set;
@@ -388,7 +380,17 @@ ctlra_ni_kontrol_z1_connect(ctlra_event_func event_func,
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 1024,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
@@ -36,6 +36,7 @@
 #include <unistd.h>
 
 #include "impl.h"
+#include "palette.h"
 #include "ni_maschine_jam.h"
 
 #define CTLRA_DRIVER_VENDOR (0x17cc)
@@ -351,6 +352,30 @@ static const struct ni_maschine_jam_ctlra_t buttons[] = {
 	 16 /* vu */ +\
 	 GRID_SIZE)
 
+/* Indexed LED colours, see the colour notes in the light flush. The code
+ * is the colour index, the LED byte is (code << 2) | brightness */
+static const struct ctlra_palette_entry_t ni_maschine_jam_palette[] = {
+	{0xff0000,  1}, /* red */
+	{0xff4000,  2}, /* orange */
+	{0xff8000,  3}, /* light orange */
+	{0xffc000,  4}, /* warm yellow */
+	{0xffff00,  5}, /* yellow */
+	{0x80ff00,  6}, /* lime */
+	{0x00ff00,  7}, /* green */
+	{0x00ff80,  8}, /* mint */
+	{0x00ffff,  9}, /* cyan */
+	{0x0080ff, 10}, /* turquoise */
+	{0x0000ff, 11}, /* blue */
+	{0x4000ff, 12}, /* plum */
+	{0x8000ff, 13}, /* violet */
+	{0xc000ff, 14}, /* purple */
+	{0xff00ff, 15}, /* magenta */
+	{0xff0080, 16}, /* fuchsia */
+	{0xffffff, 17}, /* white */
+};
+#define PALETTE_SIZE (sizeof(ni_maschine_jam_palette) / \
+		      sizeof(ni_maschine_jam_palette[0]))
+
 /* Represents the the hardware device */
 struct ni_maschine_jam_t {
 	/* base handles usb i/o etc */
@@ -361,8 +386,11 @@ struct ni_maschine_jam_t {
 
 	/* current value of each controller is stored here */
 	float hw_values[CONTROLS_SIZE];
-	/* current state of the lights, only flush on dirty */
+	/* current state of the lights, only flush on dirty. Each output
+	 * report has its own flag */
 	uint8_t lights_dirty;
+	uint8_t touchstrips_dirty;
+	uint8_t grid_dirty;
 
 	uint8_t encoder;
 
@@ -371,6 +399,15 @@ struct ni_maschine_jam_t {
 
 	uint8_t grid[GRID_SIZE];
 	uint8_t touchstrips[TOUCHSTRIP_LEDS_SIZE];
+
+	/* colour to colour index lookup, built at probe */
+	struct ctlra_palette_t palette;
+
+	/* last payload sent for each report (without the report id), a
+	 * report is only written if its bytes differ from these */
+	uint8_t lights_sent[64+1];
+	uint8_t touchstrips_sent[TOUCHSTRIP_LEDS_SIZE-1];
+	uint8_t grid_sent[GRID_SIZE-1];
 };
 
 static const char *
@@ -402,21 +439,6 @@ ni_maschine_jam_light_flush(struct ctlra_dev_t *base, uint32_t force);
 void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				uint8_t *data, uint32_t size);
 
-static uint32_t ni_maschine_jam_poll(struct ctlra_dev_t *base)
-{
-	struct ni_maschine_jam_t *dev = (struct ni_maschine_jam_t *)base;
-	uint8_t buf[1024];
-	int32_t nbytes;
-
-	nbytes = ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-						   USB_ENDPOINT_READ,
-						   buf, 1024);
-
-	(void)nbytes; // keep gcc7 happy
-
-	return 0;
-}
-
 /* 11 values per touchstrip */
 static void
 ni_maschine_jam_touchstrip_led(struct ctlra_dev_t *base,
@@ -426,6 +448,12 @@ ni_maschine_jam_touchstrip_led(struct ctlra_dev_t *base,
 	struct ni_maschine_jam_t *dev = (struct ni_maschine_jam_t *)base;
 	for(int i = 0; i < 11; i++)
 		dev->touchstrips[1+touchstrip_id*11+i] = values[i];
+	/* not set through ctlra_dev_light_set(), so the next flush must
+	 * be told about it explicitly. The grid report is sent from the
+	 * touchstrip buffer too, so it is dirty as well */
+	dev->touchstrips_dirty = 1;
+	dev->grid_dirty = 1;
+	base->light_changed = 1;
 }
 
 void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
@@ -446,8 +474,14 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 		};
 		struct ctlra_event_t *e = {&event};
 
+		/* the whole report is touchstrips, skip it if unwanted */
+		if(!ctlra_dev_impl_event_type_wanted(base, CTLRA_EVENT_SLIDER))
+			break;
+
 		/* touchstrips: 16 timestamp, 16 single-touch, 16 double */
 		for(uint32_t i = 0; i < SLIDERS_SIZE / 3; i++) {
+			if(!ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_SLIDER, i))
+				continue;
 			/* first byte is 0x2 indicating touchstrips,
 			 * 2 bytes last-used-timestamp,
 			 * 2 bytes single-touch,
@@ -473,8 +507,7 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				dev->hw_values[offset  ] = ts;
 				dev->hw_values[offset+1] = t1;
 				dev->hw_values[offset+2] = t2;
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 
 				uint8_t lights[11] = {0};
 				for(int i = 0; i < 11; i++)
@@ -508,18 +541,27 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			},
 		};
 		struct ctlra_event_t *e = {&event};
-		for(int r = 0; r < 8; r++) {
+		/* controls the app didn't subscribe to are not decoded */
+		const int want_grid =
+			ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_GRID, 0) ||
+			ctlra_dev_impl_event_type_wanted(base,
+						CTLRA_EVENT_GRID_SNAPSHOT);
+		/* pressed pads, taken from the report for the snapshot */
+		uint64_t pads = 0;
+		for(int r = 0; want_grid && r < 8; r++) {
 			uint16_t d = *(uint16_t *)&data[4+r];// & 0x3fc;
+			pads |= (uint64_t)((data[4+1+r] & 0x1) != 0) << (r*8+6);
+			pads |= (uint64_t)((data[4+1+r] & 0x2) != 0) << (r*8+7);
 			/* columns */
 			for(int c = 0; c < 6; c++) {
 				uint8_t p = d & col_mask[c];
+				pads |= (uint64_t)(p != 0) << (r*8+c);
 				if(p != dev->grid[r*8+c]) {
 					dev->grid[r*8+c] = p;
 					e->grid.pos = (r * 8) + c;
 					e->grid.pressed = p;
 					printf("%d %d = %d\n", r, c, p > 0);
-					dev->base.event_func(&dev->base, 1, &e,
-							     dev->base.event_func_userdata);
+					ctlra_dev_impl_event_add(&dev->base, e);
 				}
 			}
 			uint8_t p = data[4+1+r] & 0x1;
@@ -528,8 +570,7 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				e->grid.pressed = p;
 				dev->grid[r*8+6] = p;
 				printf("%d %d = %d\n", r, 6, p);
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 			p = data[4+1+r] & 0x2;
 			if(p != dev->grid[r*8+7]) {
@@ -537,14 +578,21 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				dev->grid[r*8+7] = p;
 				e->grid.pressed = p;
 				e->grid.pos = (r * 8) + 7;
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 
+		/* all 64 pads in one event, if anything changed */
+		if(want_grid)
+			ctlra_dev_impl_grid_snapshot(base, 0, 64, pads, 0);
+
 		/* buttons */
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
+		const int want_buttons =
+			ctlra_dev_impl_event_type_wanted(base, CTLRA_EVENT_BUTTON);
+		for(uint32_t i = 0; want_buttons && i < BUTTONS_SIZE; i++) {
 			int id     = buttons[i].event_id;
+			if(!ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_BUTTON, id))
+				continue;
 			int offset = buttons[i].buf_byte_offset;
 			int mask   = buttons[i].mask;
 
@@ -561,8 +609,7 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 						.pressed = v > 0},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 
 #if 0
 				/* debug surrounding lights */
@@ -579,7 +626,8 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 
 		/* encoder */
 		uint8_t encoder_now = (data[1] & 0xf);
-		if(dev->encoder != encoder_now) {
+		if(dev->encoder != encoder_now &&
+		   ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_ENCODER, 0)) {
 			int dir = ctlra_dev_encoder_wrap_16(encoder_now,
 							    dev->encoder);
 			dev->encoder = encoder_now;
@@ -592,27 +640,56 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			};
 			event.encoder.delta = dir;
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 	} /* case 17 */
 	} /* switch */
 }
 
+/* Convert a ctlra light status to an indexed colour LED byte. Of the 4
+ * brightness steps, the brightest is a pale tint of the colour, so only
+ * the first 3 are used */
+static inline uint8_t
+ni_maschine_jam_light_byte(struct ni_maschine_jam_t *dev,
+			   uint32_t light_status)
+{
+	if(light_status == 0)
+		return 0;
+	return (ctlra_palette_code(&dev->palette, light_status) << 2) |
+	       ctlra_palette_level(light_status, 3);
+}
+
 static void ni_maschine_jam_light_set(struct ctlra_dev_t *base,
 				    uint32_t light_id,
 				    uint32_t light_status)
 {
 	struct ni_maschine_jam_t *dev = (struct ni_maschine_jam_t *)base;
-	int ret;
 
 	if(!dev || light_id > NI_MASCHINE_JAM_LED_COUNT)
 		return;
 
-	/* write brighness to all LEDs */
-	uint32_t bright = (light_status >> 24) & 0x7F;
-/* base brightness */
-	dev->lights[light_id] = bright | 0x2;
+	dev->lights[light_id] = ni_maschine_jam_light_byte(dev, light_status);
+
+	dev->lights_dirty = 1;
+}
+
+static void
+ni_maschine_jam_lights_set_range(struct ctlra_dev_t *base,
+				 uint32_t first_id,
+				 uint32_t count,
+				 const uint32_t *status)
+{
+	struct ni_maschine_jam_t *dev = (struct ni_maschine_jam_t *)base;
+
+	/* same limit as ni_maschine_jam_light_set() */
+	if(first_id > NI_MASCHINE_JAM_LED_COUNT)
+		return;
+	if(count > NI_MASCHINE_JAM_LED_COUNT + 1 - first_id)
+		count = NI_MASCHINE_JAM_LED_COUNT + 1 - first_id;
+
+	uint8_t *l = &dev->lights[first_id];
+	for(uint32_t i = 0; i < count; i++)
+		l[i] = ni_maschine_jam_light_byte(dev, status[i]);
 
 	dev->lights_dirty = 1;
 }
@@ -629,7 +706,8 @@ static void
 ni_maschine_jam_light_flush(struct ctlra_dev_t *base, uint32_t force)
 {
 	struct ni_maschine_jam_t *dev = (struct ni_maschine_jam_t *)base;
-	if(!dev->lights_dirty && !force)
+	if(!dev->lights_dirty && !dev->touchstrips_dirty &&
+	   !dev->grid_dirty && !force)
 		return;
 	/* technically interface 3, testing showed 0 works but 3 doesnt */
 	uint8_t *data = &dev->lights_interface;
@@ -655,33 +733,67 @@ ni_maschine_jam_light_flush(struct ctlra_dev_t *base, uint32_t force)
 
 	int ret;
 
-	data[0] = 0x80;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     data,
-						     64+2);
-	if(ret < 0)
-		printf("%s write failed, ret %d\n", __func__, ret);
+	/* work out which reports changed before writing any, the report
+	 * id in touchstrips[0] is rewritten between the last two */
+	const int send_btn = force || (dev->lights_dirty &&
+		memcmp(&data[1], dev->lights_sent, sizeof(dev->lights_sent)));
+	const int send_touch = force || (dev->touchstrips_dirty &&
+		memcmp(&dev->touchstrips[1], dev->touchstrips_sent,
+		       sizeof(dev->touchstrips_sent)));
+	const int send_grid = force || (dev->grid_dirty &&
+		memcmp(&dev->touchstrips[1], dev->grid_sent,
+		       sizeof(dev->grid_sent)));
+
+	if(send_btn) {
+		data[0] = 0x80;
+		ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
+							 USB_ENDPOINT_WRITE,
+							 data,
+							 64+2);
+		if(ret < 0) {
+			printf("%s write failed, ret %d\n", __func__, ret);
+			return;
+		}
+		memcpy(dev->lights_sent, &data[1], sizeof(dev->lights_sent));
+	}
+	dev->lights_dirty = 0;
 
 	/* touchstrips */
-	dev->touchstrips[0] = 0x82;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     dev->touchstrips,
-						     88+2);
-	if(ret < 0)
-		printf("%s touchstrip write failed, ret %d\n", __func__, ret);
+	if(send_touch) {
+		dev->touchstrips[0] = 0x82;
+		ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
+							 USB_ENDPOINT_WRITE,
+							 dev->touchstrips,
+							 88+2);
+		if(ret < 0) {
+			printf("%s touchstrip write failed, ret %d\n",
+			       __func__, ret);
+			return;
+		}
+		memcpy(dev->touchstrips_sent, &dev->touchstrips[1],
+		       sizeof(dev->touchstrips_sent));
+	}
+	dev->touchstrips_dirty = 0;
+
+	if(!send_grid) {
+		dev->grid_dirty = 0;
+		return;
+	}
 
 	/* writing the LED button a *second time* (see above) allows grid
 	 * messages to work afterwards. If this 2nd button data is removed,
-	 * the grid message later is ignored for some reason */
+	 * the grid message later is ignored for some reason. Use its own
+	 * key so it is not coalesced with a queued first button write */
 	data[0] = 0x80;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
+	ret = ctlra_dev_impl_usb_interrupt_write_key(base, USB_HANDLE_IDX,
 						     USB_ENDPOINT_WRITE,
 						     data,
-						     64+2);
-	if(ret < 0)
+						     64+2,
+						     (0x80 << 8) | 0x81);
+	if(ret < 0) {
 		printf("%s 2nd btn write failed, ret %d\n", __func__, ret);
+		return;
+	}
 
 	/* grid */
 	dev->touchstrips[0] = 0x81;
@@ -689,8 +801,12 @@ ni_maschine_jam_light_flush(struct ctlra_dev_t *base, uint32_t force)
 						     USB_ENDPOINT_WRITE,
 						     dev->touchstrips,
 						     79+2);
-	if(ret < 0)
+	if(ret < 0) {
 		printf("%s grid write failed, ret %d\n", __func__, ret);
+		return;
+	}
+	memcpy(dev->grid_sent, &dev->touchstrips[1], sizeof(dev->grid_sent));
+	dev->grid_dirty = 0;
 }
 
 static int32_t
@@ -716,39 +832,59 @@ struct ctlra_dev_t *
 ctlra_ni_maschine_jam_connect(ctlra_event_func event_func,
 			      void *userdata, void *future)
 {
-	(void)future;
 	struct ni_maschine_jam_t *dev =
 		calloc(1, sizeof(struct ni_maschine_jam_t));
 	if(!dev)
 		goto fail;
 
 	int err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err)
 		goto fail;
 
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
 	if(err)
-		goto fail;
+		goto fail_close;
 
 	dev->base.info = ctlra_ni_maschine_jam_info;
 
-	dev->base.poll = ni_maschine_jam_poll;
 	dev->base.disconnect = ni_maschine_jam_disconnect;
 	dev->base.light_set = ni_maschine_jam_light_set;
+	dev->base.lights_set_range = ni_maschine_jam_lights_set_range;
 	dev->base.light_flush = ni_maschine_jam_light_flush;
 	dev->base.usb_read_cb = ni_machine_jam_usb_read_cb;
 
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	ctlra_palette_init(&dev->palette, ni_maschine_jam_palette,
+			   PALETTE_SIZE, CTLRA_PALETTE_CHROMA);
+
 	uint8_t *data = &dev->lights_interface;
 	for(int i = 0; i < NI_MASCHINE_JAM_LED_COUNT; i++) {
 		data[i] = 0x06;
 	}
+	/* device LED state is unknown, make the first flush send all */
+	memset(dev->lights_sent, 0xff, sizeof(dev->lights_sent));
+	memset(dev->touchstrips_sent, 0xff, sizeof(dev->touchstrips_sent));
+	memset(dev->grid_sent, 0xff, sizeof(dev->grid_sent));
+	dev->lights_dirty = 1;
+	dev->touchstrips_dirty = 1;
+	dev->grid_dirty = 1;
+
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 1024,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
 
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
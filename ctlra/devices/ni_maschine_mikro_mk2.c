@@ -241,16 +241,6 @@ ni_maschine_mikro_mk2_control_get_name(enum ctlra_event_type_t type,
 	return 0;
 }
 
-static uint32_t ni_maschine_mikro_mk2_poll(struct ctlra_dev_t *base)
-{
-	struct ni_maschine_mikro_mk2_t *dev = (struct ni_maschine_mikro_mk2_t *)base;
-	uint8_t buf[1024];
-	ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-					  USB_ENDPOINT_READ,
-					  buf, 1024);
-	return 0;
-}
-
 void
 ni_maschine_mikro_mk2_light_flush(struct ctlra_dev_t *base, uint32_t force);
 
@@ -277,127 +267,125 @@ ni_maschine_mikro_mk2_usb_read_cb(struct ctlra_dev_t *base,
 	static double worst_poll;
 	int32_t nbytes = size;
 
-	int count = 0;
+	uint8_t *buf = data;
 
-	do {
-		uint8_t *buf = data;
+	switch(nbytes) {
+	case 65: {
+		int i;
+		/* pad state of the whole report, for the grid snapshot */
+		uint64_t pressed = 0;
+		uint8_t pressure[NPADS];
+		for (i = 0; i < NPADS; i++) {
+			uint16_t new = ((data[i*2+2] & 0xf) << 8) |
+					 data[i*2+1];
 
-		switch(nbytes) {
-		case 65: {
-			int i;
-			for (i = 0; i < NPADS; i++) {
-				uint16_t new = ((data[i*2+2] & 0xf) << 8) |
-						 data[i*2+1];
+			uint8_t idx = dev->pad_idx[i]++ & KERNEL_MASK;
 
-				uint8_t idx = dev->pad_idx[i]++ & KERNEL_MASK;
-
-				uint16_t total = 0;
-				for(int j = 0; j < KERNEL_LENGTH; j++) {
-					int idx = i*KERNEL_LENGTH + j;
-					total += dev->pad_pressures[idx];
-				}
+			uint16_t total = 0;
+			for(int j = 0; j < KERNEL_LENGTH; j++) {
+				int idx = i*KERNEL_LENGTH + j;
+				total += dev->pad_pressures[idx];
+			}
 
-				dev->pad_avg[i] = total / KERNEL_LENGTH;
-				dev->pad_pressures[i*KERNEL_LENGTH + idx] = new;
+			dev->pad_avg[i] = total / KERNEL_LENGTH;
+			dev->pad_pressures[i*KERNEL_LENGTH + idx] = new;
 
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_GRID,
-					.grid  = {
-						.id = 0,
-						.flags = CTLRA_EVENT_GRID_FLAG_BUTTON,
-						.pos = i,
-						.pressed = 1
-					},
-				};
-				struct ctlra_event_t *e = {&event};
-
-				uint16_t med = qsort_median(
-					&dev->pad_pressures[i*KERNEL_LENGTH],
-					KERNEL_LENGTH);
-
-				if(med > 550 && dev->pads[i] == 0) {
-					/* TODO: improve velocity linearity */
-					float velo = (med - 550) / 3500.f;
-					float v2 = velo * velo * velo * velo;
-					float fin = (velo - v2) * 3;
-					fin = fin > 1.0f ? 1.0f : fin;
-					fin = fin < 0.0f ? 0.0f : fin;
-					e->grid.pressure = fin;
-					dev->base.event_func(&dev->base, 1, &e,
-					                     dev->base.event_func_userdata);
-					dev->lights[NI_MASCHINE_MIKRO_MK2_LED_PAD_1+3+i*3] = 0x7f;
-					dev->lights_dirty = 1;
-					ni_maschine_mikro_mk2_light_flush(&dev->base, 1);
-					dev->pads[i] = 2000;
-				} else if(med < 100 && dev->pads[i] > 0) {
-					dev->lights[NI_MASCHINE_MIKRO_MK2_LED_PAD_1+3+i*3] = 0;
-					dev->lights_dirty = 1;
-					ni_maschine_mikro_mk2_light_flush(&dev->base, 1);
-					dev->pads[i] = 0;
-					event.grid.pressed = 0;
-					event.grid.pressure = 0.f;
-					dev->base.event_func(&dev->base, 1, &e,
-					                     dev->base.event_func_userdata);
-				}
-			}
-		}
-		break;
-		case 6: {
-			/* Encoder */
 			struct ctlra_event_t event = {
-				.type = CTLRA_EVENT_ENCODER,
-				.encoder = {
-					.id = NI_MASCHINE_MIKRO_MK2_BTN_ENCODER_ROTATE,
-					.flags = CTLRA_EVENT_ENCODER_FLAG_INT,
-					.delta = 0,
+				.type = CTLRA_EVENT_GRID,
+				.grid  = {
+					.id = 0,
+					.flags = CTLRA_EVENT_GRID_FLAG_BUTTON,
+					.pos = i,
+					.pressed = 1
 				},
 			};
 			struct ctlra_event_t *e = {&event};
-			int8_t enc   = ((buf[5] & 0x0f)     ) & 0xf;
-			if(enc != dev->encoder_value) {
-				int dir = ctlra_dev_encoder_wrap_16(enc, dev->encoder_value);
-				event.encoder.delta = dir;
-				dev->encoder_value = enc;
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-			}
 
-			/* Buttons */
-			for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-				int id     = buttons[i].event_id;
-				int offset = buttons[i].buf_byte_offset;
-				int mask   = buttons[i].mask;
-
-				uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-				int value_idx = i;
-
-				if(dev->hw_values[value_idx] != v) {
-					//printf("%s %d\n",
-					//ni_maschine_mikro_mk2_control_names[i], i);
-					dev->hw_values[value_idx] = v;
-
-					struct ctlra_event_t event = {
-						.type = CTLRA_EVENT_BUTTON,
-						.button  = {
-							.id = id,
-							.pressed = v > 0
-						},
-					};
-					struct ctlra_event_t *e = {&event};
-					dev->base.event_func(&dev->base, 1, &e,
-					                     dev->base.event_func_userdata);
-				}
+			uint16_t med = qsort_median(
+				&dev->pad_pressures[i*KERNEL_LENGTH],
+				KERNEL_LENGTH);
+
+			if(med > 550 && dev->pads[i] == 0) {
+				/* TODO: improve velocity linearity */
+				float velo = (med - 550) / 3500.f;
+				float v2 = velo * velo * velo * velo;
+				float fin = (velo - v2) * 3;
+				fin = fin > 1.0f ? 1.0f : fin;
+				fin = fin < 0.0f ? 0.0f : fin;
+				e->grid.pressure = fin;
+				ctlra_dev_impl_event_add(&dev->base, e);
+				dev->lights[NI_MASCHINE_MIKRO_MK2_LED_PAD_1+3+i*3] = 0x7f;
+				dev->lights_dirty = 1;
+				ctlra_dev_impl_light_shadow_invalidate(&dev->base,
+					NI_MASCHINE_MIKRO_MK2_LED_PAD_1 + i);
+				ni_maschine_mikro_mk2_light_flush(&dev->base, 1);
+				dev->pads[i] = 2000;
+			} else if(med < 100 && dev->pads[i] > 0) {
+				dev->lights[NI_MASCHINE_MIKRO_MK2_LED_PAD_1+3+i*3] = 0;
+				dev->lights_dirty = 1;
+				ctlra_dev_impl_light_shadow_invalidate(&dev->base,
+					NI_MASCHINE_MIKRO_MK2_LED_PAD_1 + i);
+				ni_maschine_mikro_mk2_light_flush(&dev->base, 1);
+				dev->pads[i] = 0;
+				event.grid.pressed = 0;
+				event.grid.pressure = 0.f;
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
-			break;
+
+			pressure[i] = dev->pads[i] ? med >> 4 : 0;
+			pressed |= (uint64_t)(dev->pads[i] != 0) << i;
 		}
+		ctlra_dev_impl_grid_snapshot(&dev->base, 0, NPADS, pressed,
+					     pressure);
+	}
+	break;
+	case 6: {
+		/* Encoder */
+		struct ctlra_event_t event = {
+			.type = CTLRA_EVENT_ENCODER,
+			.encoder = {
+				.id = NI_MASCHINE_MIKRO_MK2_BTN_ENCODER_ROTATE,
+				.flags = CTLRA_EVENT_ENCODER_FLAG_INT,
+				.delta = 0,
+			},
+		};
+		struct ctlra_event_t *e = {&event};
+		int8_t enc   = ((buf[5] & 0x0f)     ) & 0xf;
+		if(enc != dev->encoder_value) {
+			int dir = ctlra_dev_encoder_wrap_16(enc, dev->encoder_value);
+			event.encoder.delta = dir;
+			dev->encoder_value = enc;
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 
-		/* LIBUSB - no re-reading! */
-		if(count++ < 10)
-			ni_maschine_mikro_mk2_poll(base);
-		else
-			break;
-	} while (nbytes > 0);
+		/* Buttons */
+		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
+			int id     = buttons[i].event_id;
+			int offset = buttons[i].buf_byte_offset;
+			int mask   = buttons[i].mask;
+
+			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
+			int value_idx = i;
+
+			if(dev->hw_values[value_idx] != v) {
+				//printf("%s %d\n",
+				//ni_maschine_mikro_mk2_control_names[i], i);
+				dev->hw_values[value_idx] = v;
+
+				struct ctlra_event_t event = {
+					.type = CTLRA_EVENT_BUTTON,
+					.button  = {
+						.id = id,
+						.pressed = v > 0
+					},
+				};
+				struct ctlra_event_t *e = {&event};
+				ctlra_dev_impl_event_add(&dev->base, e);
+			}
+		}
+		break;
+	}
+	}
 }
 
 static void ni_maschine_mikro_mk2_light_set(struct ctlra_dev_t *base,
@@ -504,11 +492,14 @@ maschine_mikro_mk2_blit_to_screen(struct ni_maschine_mikro_mk2_t *dev)
 
 		data[1] = i * 32;
 
-		ctlra_dev_impl_usb_interrupt_write(&dev->base,
-						   USB_HANDLE_IDX,
-						   USB_ENDPOINT_WRITE,
-						   data,
-						   SCREEN_XFER_SIZE);
+		/* all segments share report id 0xE0, key on the offset
+		 * too so queued segments do not replace each other */
+		ctlra_dev_impl_usb_interrupt_write_key(&dev->base,
+						       USB_HANDLE_IDX,
+						       USB_ENDPOINT_WRITE,
+						       data,
+						       SCREEN_XFER_SIZE,
+						       (data[0] << 8) | data[1]);
 	}
 }
 
@@ -556,7 +547,6 @@ struct ctlra_dev_t *
 ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 				    void *userdata, void *future)
 {
-	(void)future;
 	struct ni_maschine_mikro_mk2_t *dev =
 		calloc(1,sizeof(struct ni_maschine_mikro_mk2_t));
 	if(!dev)
@@ -564,7 +554,8 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 
 	int err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err) {
 		free(dev);
 		return 0;
@@ -574,8 +565,7 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
 	if(err) {
 		printf("error opening interface\n");
-		free(dev);
-		return 0;
+		goto fail_close;
 	}
 
 	dev->base.info = ctlra_ni_maschine_mikro_mk2_info;
@@ -598,7 +588,6 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 	dev->base.info.vendor_id = CTLRA_DRIVER_VENDOR;
 	dev->base.info.device_id = CTLRA_DRIVER_DEVICE;
 
-	dev->base.poll = ni_maschine_mikro_mk2_poll;
 	dev->base.disconnect = ni_maschine_mikro_mk2_disconnect;
 	dev->base.light_set = ni_maschine_mikro_mk2_light_set;
 	dev->base.light_flush = ni_maschine_mikro_mk2_light_flush;
@@ -609,7 +598,17 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 
 	maschine_mikro_mk2_blit_to_screen(dev);
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 1024,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
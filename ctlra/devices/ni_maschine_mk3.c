@@ -29,6 +29,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -40,6 +41,7 @@
 #include <sys/time.h>
 
 #include "impl.h"
+#include "palette.h"
 
 // Uncomment to debug pad on/off
 //#define CTLRA_MK3_PADS 1
@@ -419,6 +421,30 @@ struct ni_screen_t {
 	uint8_t footer [sizeof(footer)];
 };
 
+/* The 16 hues of the RGB LEDs, and white. The code is the hue value
+ * placed in the upper 6 bits of an LED byte */
+static const struct ctlra_palette_entry_t ni_maschine_mk3_palette[] = {
+	{0xff0000,  1}, /* red */
+	{0xff4000,  2}, /* orange */
+	{0xff8000,  3}, /* light orange */
+	{0xffc000,  4}, /* warm yellow */
+	{0xffff00,  5}, /* yellow */
+	{0x80ff00,  6}, /* lime */
+	{0x00ff00,  7}, /* green */
+	{0x00ff80,  8}, /* mint */
+	{0x00ffff,  9}, /* cyan */
+	{0x0080ff, 10}, /* turquoise */
+	{0x0000ff, 11}, /* blue */
+	{0x4000ff, 12}, /* plum */
+	{0x8000ff, 13}, /* violet */
+	{0xc000ff, 14}, /* purple */
+	{0xff00ff, 15}, /* magenta */
+	{0xff0080, 16}, /* fuchsia */
+	{0xffffff, 0x3f}, /* white */
+};
+#define PALETTE_SIZE (sizeof(ni_maschine_mk3_palette) / \
+		      sizeof(ni_maschine_mk3_palette[0]))
+
 /* Represents the the hardware device */
 struct ni_maschine_mk3_t {
 	/* base handles usb i/o etc */
@@ -435,6 +461,12 @@ struct ni_maschine_mk3_t {
 
 	uint8_t lights_pads_endpoint;
 	uint8_t lights_pads[LIGHTS_PADS_SIZE];
+	/* colour to hue code lookup, built at probe */
+	struct ctlra_palette_t palette;
+	/* last bytes sent for each report, a report is only written if
+	 * its bytes differ from these */
+	uint8_t lights_sent[LIGHTS_SIZE];
+	uint8_t lights_pads_sent[LIGHTS_PADS_SIZE];
 	uint8_t pad_colour;
 
 	/* state of the pedal, according to the hardware */
@@ -445,13 +477,23 @@ struct ni_maschine_mk3_t {
 	/* Pressure filtering for note-onset detection */
 	uint64_t pad_last_msg_time;
 	uint16_t pad_hit;
+	/* 8 bit pressure of each pad by grid position, for snapshots */
+	uint8_t pad_snapshot_pressure[16];
 	uint16_t pad_idx[NPADS];
 	uint16_t pad_pressures[NPADS*KERNEL_LENGTH];
 
-	struct ni_screen_t screen_left;
-	struct ni_screen_t screen_right;
+	/* double buffered, each holds a struct ni_screen_t */
+	struct ctlra_usb_fb_t screen[2];
 };
 
+/* Returns the back buffer of screen *scr* to render into */
+static inline struct ni_screen_t *
+ni_maschine_mk3_screen(struct ni_maschine_mk3_t *dev, int scr)
+{
+	struct ctlra_usb_fb_t *fb = &dev->screen[scr];
+	return (struct ni_screen_t *)ctlra_dev_impl_usb_fb_back(fb);
+}
+
 static const char *
 ni_maschine_mk3_control_get_name(enum ctlra_event_type_t type,
                                        uint32_t control_id)
@@ -465,16 +507,6 @@ ni_maschine_mk3_control_get_name(enum ctlra_event_type_t type,
 	return 0;
 }
 
-static uint32_t ni_maschine_mk3_poll(struct ctlra_dev_t *base)
-{
-	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
-	uint8_t buf[128];
-	ctlra_dev_impl_usb_interrupt_read(base, USB_HANDLE_IDX,
-					  USB_ENDPOINT_READ,
-					  buf, 128);
-	return 0;
-}
-
 void
 ni_maschine_mk3_light_flush(struct ctlra_dev_t *base, uint32_t force);
 
@@ -521,6 +553,8 @@ ni_maschine_mk3_pads_decode_set(struct ni_maschine_mk3_t *dev,
 		/* pad number is zero when list of pads has ended */
 		if(p == 0 && d1 == 0)
 			break;
+		if(p >= 16)
+			continue;
 
 		/* software threshold for gentle release */
 		uint16_t pressure = ((d1 & 0xf) << 8) | d2;
@@ -531,6 +565,9 @@ ni_maschine_mk3_pads_decode_set(struct ni_maschine_mk3_t *dev,
 
 		/* store pressure value for setting in event later */
 		pad_pressures[p] = pressure;
+		const int pos = (3-(p/4))*4 + (p%4);
+		dev->pad_snapshot_pressure[pos] = (rpt_pressed & (1 << p)) ?
+						  pressure >> 4 : 0;
 	}
 
 	for(int i = 0; i < 16; i++) {
@@ -547,8 +584,7 @@ ni_maschine_mk3_pads_decode_set(struct ni_maschine_mk3_t *dev,
 		event.grid.pressed = press;
 		event.grid.pressure = pad_pressures[i] * (1 / 4096.f) * press;
 
-		dev->base.event_func(&dev->base, 1, &e,
-				     dev->base.event_func_userdata);
+		ctlra_dev_impl_event_add(&dev->base, e);
 #ifdef CTLRA_MK3_PADS
 		dev->lights_pads[25+i] = dev->pad_colour * event.grid.pressed;
 		ni_maschine_mk3_light_flush(&dev->base, 1);
@@ -599,6 +635,15 @@ ni_maschine_mk3_pads(struct ni_maschine_mk3_t *dev,
 	/* call for Set A, then again for set B */
 	ni_maschine_mk3_pads_decode_set(dev, &buf[0]);
 	ni_maschine_mk3_pads_decode_set(dev, &buf[64]);
+
+	/* one snapshot for the report, in grid position order */
+	uint64_t pressed = 0;
+	for(int i = 0; i < 16; i++) {
+		if(dev->pad_hit & (1 << i))
+			pressed |= 1ull << ((3-(i/4))*4 + (i%4));
+	}
+	ctlra_dev_impl_grid_snapshot(&dev->base, 0, 16, pressed,
+				     dev->pad_snapshot_pressure);
 };
 
 void
@@ -620,12 +665,19 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 		/* Return of LED state, after update written to device */
 		} break;
 	case 128:
-		ni_maschine_mk3_pads(dev, data);
+		if(ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_GRID, 0) ||
+		   ctlra_dev_impl_event_type_wanted(base,
+						    CTLRA_EVENT_GRID_SNAPSHOT))
+			ni_maschine_mk3_pads(dev, data);
 		break;
 	case 42: {
+		/* controls the app didn't subscribe to are not decoded */
+		const int want_buttons =
+			ctlra_dev_impl_event_type_wanted(base, CTLRA_EVENT_BUTTON);
+
 		/* pedal */
 		int pedal = buf[3] > 0;
-		if(pedal != dev->pedal) {
+		if(want_buttons && pedal != dev->pedal) {
 			printf("PEDAL: %d, inv = %d\n", pedal, !pedal);
 			struct ctlra_event_t event[] = {
 				{ .type = CTLRA_EVENT_BUTTON,
@@ -640,17 +692,16 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 				}
 			};
 			struct ctlra_event_t *e = &event[0];
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 			e = &event[1];
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 			dev->pedal = pedal;
 		}
 
 		/* touchstrip: dont send event if 0, as this is release */
 		uint16_t v = *((uint16_t *)&buf[30]);
-		if(v && v != dev->touchstrip_value) {
+		if(v && v != dev->touchstrip_value &&
+		   ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_SLIDER, 0)) {
 			struct ctlra_event_t event = {
 				.type = CTLRA_EVENT_SLIDER,
 				.slider = {
@@ -659,13 +710,14 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 				},
 			};
 			struct ctlra_event_t *e = {&event};
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 			dev->touchstrip_value = v;
 		}
 
 		/* Buttons */
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
+		for(uint32_t i = 0; want_buttons && i < BUTTONS_SIZE; i++) {
+			if(!ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_BUTTON, i))
+				continue;
 			int id     = buttons[i].event_id;
 			int offset = buttons[i].buf_byte_offset;
 			int mask   = buttons[i].mask;
@@ -684,13 +736,17 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 					},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 			}
 		}
 
 		/* 8 float-style endless encoders under screen */
-		for(uint32_t i = 0; i < 8; i++) {
+		const int want_encoders =
+			ctlra_dev_impl_event_type_wanted(base, CTLRA_EVENT_ENCODER);
+		for(uint32_t i = 0; want_encoders && i < 8; i++) {
+			if(!ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_ENCODER,
+							i + 1))
+				continue;
 			uint16_t v = *((uint16_t *)&buf[12+i*2]);
 			const float value = v / 1000.f;
 			const uint8_t idx = BUTTONS_SIZE + i;
@@ -712,8 +768,7 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 					},
 				};
 				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
+				ctlra_dev_impl_event_add(&dev->base, e);
 				dev->hw_values[idx] = value;
 			}
 		}
@@ -729,24 +784,58 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 		};
 		struct ctlra_event_t *e = {&event};
 		int8_t enc   = buf[11] & 0x0f;
-		if(enc != dev->encoder_value) {
+		if(enc != dev->encoder_value &&
+		   ctlra_dev_impl_event_wanted(base, CTLRA_EVENT_ENCODER, 0)) {
 			int dir = ctlra_dev_encoder_wrap_16(enc, dev->encoder_value);
 			event.encoder.delta = dir;
 			dev->encoder_value = enc;
-			dev->base.event_func(&dev->base, 1, &e,
-					     dev->base.event_func_userdata);
+			ctlra_dev_impl_event_add(&dev->base, e);
 		}
 		break;
 		} /* case 42: buttons */
 	}
 }
 
+/* Convert a ctlra light status to the byte the device expects for the
+ * LED at *idx*, where idx < LIGHTS_SIZE are buttons and the rest are the
+ * 25 strip + 16 pad LEDs */
+static inline uint8_t
+ni_maschine_mk3_light_byte(struct ni_maschine_mk3_t *dev, uint32_t idx,
+			   uint32_t light_status)
+{
+	uint32_t bright = light_status >> 27;
+	uint8_t hue = ctlra_palette_code(&dev->palette, light_status);
+
+	/* if the input was totally zero, set the LED off */
+	if(light_status == 0)
+		hue = 0;
+
+	/* 25 strip + 16 pads */
+	if(idx >= LIGHTS_SIZE)
+		return (hue << 2) | (bright & 0x3);
+
+	/* normal LEDs */
+	switch(idx) {
+	/* Sampling */
+	case 5:
+	/* ABCDEFGH */
+	case 29: case 30: case 31: case 32:
+	case 33: case 34: case 35: case 36:
+	/* Encoder up, left, right, down */
+	case 58: case 59: case 60: case 61:
+		return (hue << 2) | ((bright >> 2) & 0x3);
+	default:
+		/* brighness 2 bits at the start of the
+		 * uint8_t for the light */
+		return bright;
+	};
+}
+
 static void ni_maschine_mk3_light_set(struct ctlra_dev_t *base,
                 uint32_t light_id,
                 uint32_t light_status)
 {
 	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
-	int ret;
 
 	if(!dev)
 		return;
@@ -755,111 +844,110 @@ static void ni_maschine_mk3_light_set(struct ctlra_dev_t *base,
 	if(light_id > (LIGHTS_SIZE + 25 + 16) - 1)
 		return;
 
-	int idx = light_id;
-	const uint8_t r = ((light_status >> 16) & 0xFF);
-	const uint8_t g = ((light_status >>  8) & 0xFF);
-	const uint8_t b = ((light_status >>  0) & 0xFF);
-
-	uint8_t max = r > g ? r : g;
-	max = b > max ? b : max;
-	uint8_t min = r < g ? r : g;
-	min = b < min ? b : min;
-
-	/* rgb to hsv: nasty, but the device requires a H value input,
-	 * so we have to calculate it here. Icky branchy divide-y... */
-	uint8_t v = max;
-	uint8_t h, s;
-	if (v == 0 || (max - min) == 0) {
-		h = 0;
-		s = 0;
+	uint8_t v = ni_maschine_mk3_light_byte(dev, light_id, light_status);
+	if(light_id < LIGHTS_SIZE) {
+		dev->lights[light_id] = v;
+		dev->lights_dirty = 1;
 	} else {
-		s = 255 * (max - min) / v;
-		if (s == 0)
-			h = 0;
-		if (max == r)
-			h = 0 + 43 * (g - b) / (max - min);
-		else if (max == g)
-			h = 85 + 43 * (b - r) / (max - min);
-		else
-			h = 171 + 43 * (r - g) / (max - min);
+		dev->lights_pads[light_id - LIGHTS_SIZE] = v;
+		dev->lights_pads_dirty = 1;
 	}
+}
 
-	uint32_t bright = light_status >> 27;
-	uint8_t hue = h / 16 + 1;
+static void
+ni_maschine_mk3_lights_set_range(struct ctlra_dev_t *base,
+				 uint32_t first_id,
+				 uint32_t count,
+				 const uint32_t *status)
+{
+	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
+	const uint32_t end = LIGHTS_SIZE + 25 + 16;
 
-	/* if equal components, then set white */
-	if(r == g && r == b)
-		hue = 0xff;
+	if(first_id >= end)
+		return;
+	if(count > end - first_id)
+		count = end - first_id;
+
+	uint32_t idx = first_id;
+	uint32_t i = 0;
+	for(; i < count && idx < LIGHTS_SIZE; i++, idx++)
+		dev->lights[idx] = ni_maschine_mk3_light_byte(dev, idx,
+							      status[i]);
+	if(i)
+		dev->lights_dirty = 1;
 
-	/* if the input was totally zero, set the LED off */
-	if(light_status == 0)
-		hue = 0;
+	if(i == count)
+		return;
+	for(; i < count; i++, idx++)
+		dev->lights_pads[idx - LIGHTS_SIZE] =
+			ni_maschine_mk3_light_byte(dev, idx, status[i]);
+	dev->lights_pads_dirty = 1;
+}
 
-	/* normal LEDs */
-	if(idx < LIGHTS_SIZE) {
-		switch(idx) {
-		/* Sampling */
-		case 5:
-		/* ABCDEFGH */
-		case 29: case 30: case 31: case 32:
-		case 33: case 34: case 35: case 36:
-		/* Encoder up, left, right, down */
-		case 58: case 59: case 60: case 61:
-		{
-			uint8_t v = (hue << 2) | ((bright >> 2) & 0x3);
-			dev->lights[idx] = v;
-		} break;
-		default:
-			/* brighness 2 bits at the start of the
-			 * uint8_t for the light */
-			dev->lights[idx] = bright;
-			break;
-		};
-		dev->lights_dirty = 1;
-	} else {
-		/* 25 strip + 16 pads */
-		uint8_t v = (hue << 2) | (bright & 0x3);
-		dev->lights_pads[idx - LIGHTS_SIZE] = v;
-		dev->lights_pads_dirty = 1;
-	}
+static int32_t
+ni_maschine_mk3_grid_lights_set_frame(struct ctlra_dev_t *base,
+				      uint32_t grid_id,
+				      uint32_t count,
+				      const uint32_t *status)
+{
+	if(grid_id != 0)
+		return -EINVAL;
+	if(count > 16)
+		count = 16;
+	/* pads are the light ids after the 25 strip LEDs. Go through the
+	 * public range call, so the light shadow stays in step and
+	 * animations on those ids stop, like a ctlra_dev_light_set() */
+	ctlra_dev_lights_set_range(base, LIGHTS_SIZE + 25, count, status);
+	return 0;
 }
 
 void
 ni_maschine_mk3_light_flush(struct ctlra_dev_t *base, uint32_t force)
 {
 	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
-	if(!dev->lights_dirty && !force)
+	if(!dev->lights_dirty && !dev->lights_pads_dirty && !force)
 		return;
 
+	int ret;
 	uint8_t *data = &dev->lights_endpoint;
 	dev->lights_endpoint = 0x80;
 
 	/* error handling in USB subsystem */
-	ctlra_dev_impl_usb_interrupt_write(base,
-					   USB_HANDLE_IDX,
-					   USB_ENDPOINT_WRITE,
-					   data,
-					   LIGHTS_SIZE + 1);
+	if(force || (dev->lights_dirty &&
+		     memcmp(dev->lights, dev->lights_sent, LIGHTS_SIZE))) {
+		ret = ctlra_dev_impl_usb_interrupt_write(base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_WRITE,
+							 data,
+							 LIGHTS_SIZE + 1);
+		if(ret < 0)
+			return;
+		memcpy(dev->lights_sent, dev->lights, LIGHTS_SIZE);
+	}
+	dev->lights_dirty = 0;
 
 	data = &dev->lights_pads_endpoint;
 	dev->lights_pads_endpoint = 0x81;
-	ctlra_dev_impl_usb_interrupt_write(base,
-					   USB_HANDLE_IDX,
-					   USB_ENDPOINT_WRITE,
-					   data,
-					   LIGHTS_SIZE + 1);
+	if(force || (dev->lights_pads_dirty &&
+		     memcmp(dev->lights_pads, dev->lights_pads_sent,
+			    LIGHTS_PADS_SIZE))) {
+		ret = ctlra_dev_impl_usb_interrupt_write(base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_WRITE,
+							 data,
+							 LIGHTS_SIZE + 1);
+		if(ret < 0)
+			return;
+		memcpy(dev->lights_pads_sent, dev->lights_pads,
+		       LIGHTS_PADS_SIZE);
+	}
+	dev->lights_pads_dirty = 0;
 }
 
 static void
 maschine_mk3_blit_to_screen(struct ni_maschine_mk3_t *dev, int scr)
 {
-	void *data = (scr == 1) ? &dev->screen_right : &dev->screen_left;
-
-	int ret = ctlra_dev_impl_usb_bulk_write(&dev->base,
-						USB_HANDLE_SCREEN_IDX,
-						USB_ENDPOINT_SCREEN_WRITE,
-						data,
-						sizeof(dev->screen_left));
+	int ret = ctlra_dev_impl_usb_fb_flush(&dev->screen[scr]);
 	if(ret < 0)
 		printf("%s screen write failed!\n", __func__);
 }
@@ -928,10 +1016,11 @@ ni_maschine_mk3_screen_get_data(struct ctlra_dev_t *base,
 		/* create a new buffer on the stack, to build up the
 		 * required commands to do a partial update */
 		uint8_t cmd[1024*1024];
+		struct ni_screen_t *left = ni_maschine_mk3_screen(dev, 0);
 
 		uint32_t idx = 0;
-		for(; idx < sizeof(dev->screen_left.header); idx++)
-			cmd[idx] = dev->screen_left.header[idx];
+		for(; idx < sizeof(left->header); idx++)
+			cmd[idx] = left->header[idx];
 
 #if 1
 
@@ -957,7 +1046,7 @@ ni_maschine_mk3_screen_get_data(struct ctlra_dev_t *base,
 
 			uint32_t px_idx = ((zone->y + 0) * 480) + zone->x;
 			printf("px idx = %d\n", px_idx);
-			uint8_t *px_in_data = (uint8_t *)&dev->screen_left.pixels[px_idx];
+			uint8_t *px_in_data = (uint8_t *)&left->pixels[px_idx];
 
 			//ni_screen_var_px(cmd, &idx, 12, px_in_data);
 			ni_screen_line(cmd, &idx, 12, 0b11111100000, 0b11111100000);
@@ -1019,8 +1108,8 @@ ni_maschine_mk3_screen_get_data(struct ctlra_dev_t *base,
 			       0b11111);
 #endif
 
-		for(int i = 0; i < sizeof(dev->screen_left.footer); i++, idx++)
-			cmd[idx] = dev->screen_left.footer[i];
+		for(int i = 0; i < sizeof(left->footer); i++, idx++)
+			cmd[idx] = left->footer[i];
 
 		ctlra_dev_impl_usb_bulk_write(&dev->base, USB_HANDLE_SCREEN_IDX,
 							USB_ENDPOINT_SCREEN_WRITE,
@@ -1034,9 +1123,7 @@ ni_maschine_mk3_screen_get_data(struct ctlra_dev_t *base,
 		return 0;
 	}
 
-	*pixels = (uint8_t *)&dev->screen_left.pixels;
-	if(screen_idx == 1)
-		*pixels = (uint8_t *)&dev->screen_right.pixels;
+	*pixels = (uint8_t *)ni_maschine_mk3_screen(dev, screen_idx)->pixels;
 
 	*bytes = NUM_PX * 2;
 
@@ -1055,12 +1142,11 @@ ni_maschine_mk3_disconnect(struct ctlra_dev_t *base)
 
 	if(!base->banished) {
 		ni_maschine_mk3_light_flush(base, 1);
-		memset(dev->screen_left.pixels, 0x0,
-		       sizeof(dev->screen_left.pixels));
-		memset(dev->screen_right.pixels, 0x0,
-		       sizeof(dev->screen_right.pixels));
-		maschine_mk3_blit_to_screen(dev, 0);
-		maschine_mk3_blit_to_screen(dev, 1);
+		for(int i = 0; i < 2; i++) {
+			struct ni_screen_t *scr = ni_maschine_mk3_screen(dev, i);
+			memset(scr->pixels, 0x0, sizeof(scr->pixels));
+			maschine_mk3_blit_to_screen(dev, i);
+		}
 	}
 
 	ctlra_dev_impl_usb_close(base);
@@ -1074,7 +1160,6 @@ struct ctlra_dev_t *
 ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 				    void *userdata, void *future)
 {
-	(void)future;
 	struct ni_maschine_mk3_t *dev =
 		calloc(1,sizeof(struct ni_maschine_mk3_t));
 	if(!dev)
@@ -1082,7 +1167,8 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 
 	int err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
-					  CTLRA_DRIVER_DEVICE);
+					  CTLRA_DRIVER_DEVICE,
+					  future);
 	if(err) {
 		free(dev);
 		return 0;
@@ -1092,8 +1178,7 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
 	if(err) {
 		printf("error opening interface\n");
-		free(dev);
-		return 0;
+		goto fail_close;
 	}
 
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
@@ -1101,25 +1186,36 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 	                                        USB_HANDLE_SCREEN_IDX);
 	if(err) {
 		printf("%s: failed to open screen usb interface\n", __func__);
-		goto fail;
+		goto fail_close;
 	}
 
-	/* initialize blit mem in driver */
-	memcpy(dev->screen_left.header , header_left, sizeof(dev->screen_left.header));
-	memcpy(dev->screen_left.command, command, sizeof(dev->screen_left.command));
-	memcpy(dev->screen_left.footer , footer , sizeof(dev->screen_left.footer));
-	/* right */
-	memcpy(dev->screen_right.header , header_right, sizeof(dev->screen_right.header));
-	memcpy(dev->screen_right.command, command, sizeof(dev->screen_right.command));
-	memcpy(dev->screen_right.footer , footer , sizeof(dev->screen_right.footer));
+	/* initialize blit mem in driver: both buffers of each screen are
+	 * prefilled with the header and footer, only pixels get redrawn */
+	for(int i = 0; i < 2; i++) {
+		struct ctlra_usb_fb_t *fb = &dev->screen[i];
+		err = ctlra_dev_impl_usb_fb_init(&dev->base, fb,
+						 USB_HANDLE_SCREEN_IDX,
+						 USB_ENDPOINT_SCREEN_WRITE,
+						 sizeof(struct ni_screen_t));
+		if(err)
+			goto fail_close;
+
+		const uint8_t *hdr = (i == 1) ? header_right : header_left;
+		for(int j = 0; j < 2; j++) {
+			struct ni_screen_t *scr = (struct ni_screen_t *)fb->buf[j];
+			memcpy(scr->header , hdr    , sizeof(scr->header));
+			memcpy(scr->command, command, sizeof(scr->command));
+			memcpy(scr->footer , footer , sizeof(scr->footer));
+		}
+	}
 
 	/* blit stuff to screen */
 	uint8_t col_1 = 0b00010000;
 	uint8_t col_2 = 0b11000011;
 	uint16_t col = (col_2 << 8) | col_1;
 
-	uint16_t *sl = dev->screen_left.pixels;
-	uint16_t *sr = dev->screen_right.pixels;
+	uint16_t *sl = ni_maschine_mk3_screen(dev, 0)->pixels;
+	uint16_t *sr = ni_maschine_mk3_screen(dev, 1)->pixels;
 
 	for(int i = 0; i < NUM_PX; i++) {
 		*sl++ = col;
@@ -1130,20 +1226,37 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 
 	dev->pad_colour = pad_cols[0];
 	dev->lights_dirty = 1;
+	ctlra_palette_init(&dev->palette, ni_maschine_mk3_palette,
+			   PALETTE_SIZE, CTLRA_PALETTE_CHROMA);
+	/* device LED state is unknown, make the first flush send all */
+	memset(dev->lights_sent, 0xff, sizeof(dev->lights_sent));
+	memset(dev->lights_pads_sent, 0xff, sizeof(dev->lights_pads_sent));
+	dev->lights_pads_dirty = 1;
 
 	dev->base.info = ctlra_ni_maschine_mk3_info;
 
-	dev->base.poll = ni_maschine_mk3_poll;
 	dev->base.usb_read_cb = ni_maschine_mk3_usb_read_cb;
 	dev->base.disconnect = ni_maschine_mk3_disconnect;
 	dev->base.light_set = ni_maschine_mk3_light_set;
+	dev->base.lights_set_range = ni_maschine_mk3_lights_set_range;
+	dev->base.grid_lights_set_frame = ni_maschine_mk3_grid_lights_set_frame;
 	dev->base.light_flush = ni_maschine_mk3_light_flush;
 	dev->base.screen_get_data = ni_maschine_mk3_screen_get_data;
 
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	err = ctlra_dev_impl_usb_interrupt_read_register(&dev->base,
+							 USB_HANDLE_IDX,
+							 USB_ENDPOINT_READ,
+							 128,
+							 CTLRA_USB_PERSISTENT_READS);
+	if(err)
+		goto fail_close;
+
 	return (struct ctlra_dev_t *)dev;
+fail_close:
+	ctlra_dev_impl_usb_close(&dev->base);
 fail:
 	free(dev);
 	return 0;
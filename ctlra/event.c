@@ -1,5 +1,9 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "event.h"
+#include "impl.h"
 
 const char *ctlra_event_type_names[] = {
 	"Button",
@@ -7,3 +11,81 @@ const char *ctlra_event_type_names[] = {
 	"Slider",
 	"Grid",
 };
+
+/* Producer and consumer indexes are on their own cache lines, so the two
+ * threads do not false-share. Indexes run freely, and are masked on use */
+struct ctlra_event_ring_t {
+	uint32_t head __attribute__((aligned(64)));
+	uint64_t overflows;
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t mask __attribute__((aligned(64)));
+	struct ctlra_event_t events[];
+};
+
+struct ctlra_event_ring_t *ctlra_event_ring_create(uint32_t size)
+{
+	uint32_t n = 1;
+	while(n < size && n < (1u << 31))
+		n <<= 1;
+
+	struct ctlra_event_ring_t *ring;
+	size_t bytes = sizeof(*ring) + n * sizeof(struct ctlra_event_t);
+	if(posix_memalign((void **)&ring, 64, bytes))
+		return 0;
+	memset(ring, 0, bytes);
+	ring->mask = n - 1;
+	return ring;
+}
+
+void ctlra_event_ring_destroy(struct ctlra_event_ring_t *ring)
+{
+	free(ring);
+}
+
+uint32_t ctlra_impl_event_ring_write(struct ctlra_event_ring_t *ring,
+				     const struct ctlra_event_t *events,
+				     uint32_t num)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t space = ring->mask + 1 - (head - tail);
+	uint32_t n = num < space ? num : space;
+
+	if(n < num)
+		__atomic_store_n(&ring->overflows, ring->overflows + (num - n),
+				 __ATOMIC_RELAXED);
+
+	uint32_t idx = head & ring->mask;
+	uint32_t first = ring->mask + 1 - idx;
+	if(first > n)
+		first = n;
+	memcpy(&ring->events[idx], events, first * sizeof(*events));
+	memcpy(&ring->events[0], &events[first], (n - first) * sizeof(*events));
+
+	__atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+uint32_t ctlra_events_read(struct ctlra_event_ring_t *ring,
+			   struct ctlra_event_t *events, uint32_t max)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t avail = head - tail;
+	uint32_t n = max < avail ? max : avail;
+
+	uint32_t idx = tail & ring->mask;
+	uint32_t first = ring->mask + 1 - idx;
+	if(first > n)
+		first = n;
+	memcpy(events, &ring->events[idx], first * sizeof(*events));
+	memcpy(&events[first], &ring->events[0], (n - first) * sizeof(*events));
+
+	__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+uint64_t ctlra_event_ring_overflows(struct ctlra_event_ring_t *ring)
+{
+	return __atomic_load_n(&ring->overflows, __ATOMIC_RELAXED);
+}
@@ -51,6 +51,10 @@ enum ctlra_event_type_t {
 	CTLRA_FEEDBACK_ITEM,
 	/* The number of event types there are */
 	CTLRA_EVENT_T_COUNT,
+	/* Optional event types follow. They are only delivered when
+	 * subscribed to with ctlra_dev_set_event_mask() */
+	/* The state of all pads of a grid, see ctlra_event_grid_snapshot_t */
+	CTLRA_EVENT_GRID_SNAPSHOT,
 };
 
 /* defined in event.c */
@@ -129,6 +133,52 @@ struct ctlra_event_grid_t {
 	uint32_t pressed;
 };
 
+#define CTLRA_GRID_SNAPSHOT_PRESSURE_MAX 16
+
+/** The state of every pad of a grid, sent once for each report from the
+ * device in which any pad changed, after the CTLRA_EVENT_GRID events of
+ * the report. It allows handling all pads of a chord in one event.
+ * The fields are 4 byte aligned and no larger than the other union
+ * members, so the layout of struct ctlra_event_t is unchanged. Use the
+ * ctlra_event_grid_snapshot_* helpers below to read the pads */
+struct ctlra_event_grid_snapshot_t {
+	/** The ID of the grid */
+	uint16_t id;
+	/** The number of pads in the grid, at most 64 */
+	uint8_t pads;
+	/** CTLRA_EVENT_GRID_FLAG_PRESSURE if *pressure* is valid */
+	uint8_t flags;
+	/** Bit N is set while the pad at position N is pressed, pads 0 to
+	 * 31 in *pressed_lo* and 32 to 63 in *pressed_hi* */
+	uint32_t pressed_lo;
+	uint32_t pressed_hi;
+	/** Pressure of the first pads, 4 bits each: pad 2N in the low
+	 * nibble of byte N, pad 2N + 1 in the high nibble */
+	uint8_t pressure[CTLRA_GRID_SNAPSHOT_PRESSURE_MAX / 2];
+};
+
+/** Returns 1 if pad *pos* of the snapshot is pressed */
+static inline int
+ctlra_event_grid_snapshot_pressed(const struct ctlra_event_grid_snapshot_t *s,
+				  uint32_t pos)
+{
+	if(pos >= 64)
+		return 0;
+	uint32_t w = pos < 32 ? s->pressed_lo : s->pressed_hi;
+	return (w >> (pos % 32)) & 1;
+}
+
+/** Returns the pressure of pad *pos* of the snapshot, 0.f to 1.f */
+static inline float
+ctlra_event_grid_snapshot_pressure(const struct ctlra_event_grid_snapshot_t *s,
+				   uint32_t pos)
+{
+	if(pos >= CTLRA_GRID_SNAPSHOT_PRESSURE_MAX)
+		return 0.f;
+	uint8_t v = s->pressure[pos / 2] >> (4 * (pos % 2));
+	return (v & 0xf) * (1 / 15.f);
+}
+
 /** The event passed around in the API */
 struct ctlra_event_t {
 	/** The type of this event */
@@ -140,7 +190,29 @@ struct ctlra_event_t {
 		struct ctlra_event_encoder_t encoder;
 		struct ctlra_event_slider_t slider;
 		struct ctlra_event_grid_t grid;
+		struct ctlra_event_grid_snapshot_t grid_snapshot;
 	};
+
+	/** CLOCK_MONOTONIC time in nanoseconds at which the report carrying
+	 * this event arrived from the device. All events decoded from one
+	 * report share the same timestamp. Appended to the struct, so the
+	 * offsets of all the fields above are unchanged */
+	uint64_t timestamp;
+};
+
+/** Bit of an event type in the *type_mask* of ctlra_dev_set_event_mask().
+ * CTLRA_EVENT_MASK_ALL selects all types except the optional ones */
+#define CTLRA_EVENT_MASK(type) (1u << (type))
+#define CTLRA_EVENT_MASK_ALL   ((1u << CTLRA_EVENT_T_COUNT) - 1)
+
+/** Control ids below this can be selected individually. Controls with
+ * higher ids are delivered whenever their type is */
+#define CTLRA_EVENT_ID_MAX 256
+
+/** A bitmap of control ids for each event type: bit N of ids[type]
+ * selects the control with id N. For grids, the id is that of the grid */
+struct ctlra_event_ids_t {
+	uint32_t ids[CTLRA_EVENT_T_COUNT][CTLRA_EVENT_ID_MAX / 32];
 };
 
 /** Callback function that is called for event(s) */
@@ -149,9 +221,46 @@ typedef void (*ctlra_event_func)(struct ctlra_dev_t* dev,
 				struct ctlra_event_t** event,
 				void *userdata);
 
+/** Callback function that is called with all events decoded from one
+ * report of the device, as a contiguous array. The array is only valid
+ * for the duration of the callback */
+typedef void (*ctlra_event_array_func)(struct ctlra_dev_t* dev,
+				       const struct ctlra_event_t *events,
+				       uint32_t num_events,
+				       void *userdata);
+
 /** Callback function that is called to update the feedback on the device,
  * eg for leds, buttons and screens */
 typedef void (*ctlra_feedback_func)(struct ctlra_dev_t *dev,
 				    void *userdata);
 
+/** A wait-free single-producer single-consumer ring of events. Attach it
+ * to one or more devices of a *ctlra_t* with *ctlra_dev_set_event_ring*,
+ * and the events of those devices are written into it by the thread that
+ * calls *ctlra_idle_iter*. Any one other thread (eg a JACK process
+ * callback) can then consume the events with *ctlra_events_read*, which
+ * takes no locks and makes no syscalls.
+ */
+struct ctlra_event_ring_t;
+
+/** Create an event ring holding at least *size* events. The size is
+ * rounded up to a power of two.
+ * @retval 0 on allocation failure
+ */
+struct ctlra_event_ring_t *ctlra_event_ring_create(uint32_t size);
+
+/** Free the ring. It must not be attached to any device anymore */
+void ctlra_event_ring_destroy(struct ctlra_event_ring_t *ring);
+
+/** Read up to *max* events from *ring* into *events*. Never blocks, and
+ * is safe to call from a realtime thread.
+ * @retval The number of events read
+ */
+uint32_t ctlra_events_read(struct ctlra_event_ring_t *ring,
+			   struct ctlra_event_t *events, uint32_t max);
+
+/** Number of events dropped since the ring was created, because the
+ * consumer did not read fast enough and the ring was full */
+uint64_t ctlra_event_ring_overflows(struct ctlra_event_ring_t *ring);
+
 #endif /* OPENAV_CTLRA_EVENT */
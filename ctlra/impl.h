@@ -43,6 +43,14 @@ extern "C" {
 #include "ctlra.h"
 #include "event.h"
 
+/* CLOCK_MONOTONIC in nanoseconds, as used for event timestamps */
+static inline uint64_t ctlra_impl_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 #define debug_print_check(c, level)					\
 	(!c || ((c->opts.debug_level & CTLRA_DEBUG_LEVEL_MASK) > level))
 
@@ -72,13 +80,38 @@ extern "C" {
 
 
 struct ctlra_dev_t;
+struct pollfd;
+
+/* An animated light, see ctlra_dev_light_animate() */
+struct ctlra_light_anim_t {
+	/* status the animation is based on, without the blink bit */
+	uint32_t status;
+	uint64_t period_ns;
+	/* offset into the period, 0 to 1, for periodic animations */
+	float phase;
+	/* CTLRA_LIGHT_ANIM_NONE when the light is not animated */
+	uint8_t type;
+	/* start of a one-shot animation */
+	uint64_t start_ns;
+};
 
 /* Functions each device can implement */
 typedef uint32_t (*ctlra_dev_impl_poll)(struct ctlra_dev_t *dev);
+/* Devices that aren't driven by libusb (eg MIDI) return the fds that
+ * become readable when poll() has work, see ctlra_get_pollfds() */
+typedef int32_t (*ctlra_dev_impl_get_pollfds)(struct ctlra_dev_t *dev,
+					      struct pollfd *fds,
+					      uint32_t max);
 typedef int32_t (*ctlra_dev_impl_disconnect)(struct ctlra_dev_t *dev);
 typedef void (*ctlra_dev_impl_light_set)(struct ctlra_dev_t *dev,
 					   uint32_t light_id,
 					   uint32_t light_status);
+/* Set *count* consecutive lights from *first_id*, converting the whole
+ * array in one pass. Ids past the device's last light are ignored */
+typedef void (*ctlra_dev_impl_lights_set_range)(struct ctlra_dev_t *dev,
+						uint32_t first_id,
+						uint32_t count,
+						const uint32_t *status);
 typedef void (*ctlra_dev_impl_feedback_set)(struct ctlra_dev_t *dev,
 					    uint32_t fb_id,
 					    float value);
@@ -101,12 +134,47 @@ typedef int32_t (*ctlra_dev_impl_grid_light_set)(struct ctlra_dev_t *dev,
 						uint32_t grid_id,
 						uint32_t light_id,
 						uint32_t light_status);
+/* Grids whose pads alias light ids must pass the frame to
+ * ctlra_dev_lights_set_range(), which keeps the light shadow valid */
+typedef int32_t (*ctlra_dev_impl_grid_lights_set_frame)(struct ctlra_dev_t *dev,
+						       uint32_t grid_id,
+						       uint32_t count,
+						       const uint32_t *status);
 typedef const char* (*ctlra_dev_impl_control_get_name)
 						(const struct ctlra_dev_t *dev,
 						enum ctlra_event_type_t type,
 						uint32_t control_id);
 
 #define CTLRA_USB_IFACE_PER_DEV 2
+/* USB 3.0 allows at most 7 tiers of hubs */
+#define CTLRA_USB_PORTS_MAX 7
+
+/** A double buffered screen framebuffer. Both buffers are allocated as
+ * transfer-ready memory (usbfs zero-copy where available), so a flush
+ * hands the back buffer to libusb without copying it. The buffers swap
+ * when the flush is submitted: a flush while the previous frame is still
+ * in flight is deferred until that transfer completes. After a flush, the
+ * back buffer holds an older frame and must be redrawn fully */
+struct ctlra_usb_fb_t {
+	uint8_t *buf[2];
+	uint8_t dev_mem[2];
+	uint32_t size;
+	/* index of the buffer to render into */
+	uint8_t back;
+	/* the front buffer is owned by libusb */
+	uint8_t in_flight;
+	/* a flush was requested while the front buffer was in flight */
+	uint8_t flush_pending;
+	/* index + 1 of the buffer holding the last flushed frame, or 0 */
+	uint8_t flushed;
+	uint32_t idx;
+	uint32_t endpoint;
+	uint64_t t_queued;
+	struct ctlra_dev_t *dev;
+	void *xfer;
+	/* next framebuffer owned by the same device */
+	struct ctlra_usb_fb_t *next;
+};
 
 struct ctlra_dev_t {
 	/* Instance and next in list */
@@ -125,6 +193,15 @@ struct ctlra_dev_t {
 
 	/* usb handle for this hardware device. */
 	void *usb_device;
+	/* handle opened by the hotplug path, used by the first call to
+	 * ctlra_dev_impl_usb_open_interface() instead of opening again */
+	void *usb_handle_probed;
+	/* physical location on the bus, recorded at open */
+	uint8_t usb_bus;
+	uint8_t usb_port_count;
+	uint8_t usb_ports[CTLRA_USB_PORTS_MAX];
+	/* index + 1 into the instance's identity map, 0 if unbound */
+	uint32_t identity;
 
 	/* Certain complex controllers require more than one
 	 * usb interface to be fully controlled (typically screen/buttons
@@ -133,8 +210,10 @@ struct ctlra_dev_t {
 	 * functions */
 	void *usb_handle[CTLRA_USB_IFACE_PER_DEV];
 	uint8_t usb_interface[CTLRA_USB_IFACE_PER_DEV];
-	/* linked list of outstanding async transfers */
-	void *usb_async_next;
+	/* pool of preallocated async transfers, see usb.c */
+	void *usb_pool;
+	/* screen framebuffers, released by usb_close */
+	struct ctlra_usb_fb_t *usb_fb_list;
 	/* statistics of USB backend */
 #define USB_XFER_INT_READ 0
 #define USB_XFER_INT_WRITE 1
@@ -146,8 +225,22 @@ struct ctlra_dev_t {
 #define USB_XFER_INFLIGHT_READ 7
 #define USB_XFER_INFLIGHT_WRITE 8
 #define USB_XFER_INFLIGHT_CANCEL 9
-#define USB_XFER_COUNT 10
+#define USB_XFER_POOL_HWM 10
+#define USB_XFER_COALESCED 11
+#define USB_XFER_INFLIGHT_BULK 12
+#define USB_XFER_BULK_COALESCED 13
+#define USB_XFER_INT_LATENCY_MAX 14
+#define USB_XFER_BULK_LATENCY_MAX 15
+#define USB_XFER_COUNT 16
 	uint32_t usb_xfer_counts[USB_XFER_COUNT];
+	/* persistent reads of ctlra_dev_impl_usb_interrupt_read_register().
+	 * usb_read_armed counts those submitted to libusb, reads that fail
+	 * to resubmit are re-armed by the idle iteration */
+	uint32_t usb_read_count;
+	uint32_t usb_read_armed;
+	uint32_t usb_read_size;
+	uint32_t usb_read_endpoint;
+	uint8_t usb_read_idx;
 
 
 	/* TODO; remove the belowusb xfer pointers */
@@ -166,16 +259,75 @@ struct ctlra_dev_t {
 	ctlra_event_func event_func;
 	ctlra_feedback_func feedback_func;
 	void *event_func_userdata;
+	/* Contiguous array variant, used instead of event_func if set */
+	ctlra_event_array_func event_array_func;
+	/* Ring that events are also written to, for another thread */
+	struct ctlra_event_ring_t *event_ring;
+
+	/* Events decoded from the current report, sent to the app in one
+	 * call by ctlra_dev_impl_event_flush() */
+#define CTLRA_EVENT_BATCH_MAX 64
+	uint32_t event_batch_count;
+	/* Inverted subscription of ctlra_dev_set_event_mask(), so that a
+	 * zeroed device receives all events. Drivers check it with
+	 * ctlra_dev_impl_event_wanted() to skip decoding */
+	uint32_t event_type_skip;
+	struct ctlra_event_ids_t event_ids_skip;
+	/* optional event types, after CTLRA_EVENT_T_COUNT, are opt-in */
+	uint32_t event_type_optional;
+	/* last grid snapshot sent, see ctlra_dev_impl_grid_snapshot() */
+	struct ctlra_event_grid_snapshot_t grid_snapshot;
+	/* Control values for ctlra_dev_get_state(), written at each flush
+	 * while state_seq is odd */
+	uint32_t state_seq;
+	struct ctlra_dev_state_t state;
+	/* Last status passed to ctlra_dev_light_set() for each light id,
+	 * valid when its bit in light_shadow_set is set. Used to stop
+	 * redundant updates before they reach the driver */
+#define CTLRA_LIGHT_SHADOW_MAX 256
+	uint32_t light_shadow[CTLRA_LIGHT_SHADOW_MAX];
+	uint32_t light_shadow_set[CTLRA_LIGHT_SHADOW_MAX / 32];
+	/* a light changed since the last ctlra_dev_light_flush() */
+	uint8_t light_changed;
+#define CTLRA_LIGHT_STAT_SET 0
+#define CTLRA_LIGHT_STAT_SET_SUPPRESSED 1
+#define CTLRA_LIGHT_STAT_FLUSH 2
+#define CTLRA_LIGHT_STAT_FLUSH_SUPPRESSED 3
+#define CTLRA_LIGHT_STAT_COUNT 4
+	uint32_t light_counts[CTLRA_LIGHT_STAT_COUNT];
+	/* Animated lights, indexed by light id. Allocated by the first
+	 * ctlra_dev_light_animate() call, and updated each
+	 * CTLRA_LIGHT_ANIM_MS by the idle iteration while any are active.
+	 * Periodic animations are aligned to light_anim_base_ns */
+	struct ctlra_light_anim_t *light_anim;
+	uint32_t light_anim_count;
+	uint64_t light_anim_base_ns;
+	uint64_t light_anim_next_ns;
+	/* hold events until ctlra_dev_poll(), merging continuous controls.
+	 * See ctlra_dev_set_coalesce() */
+	uint8_t event_coalesce;
+#define CTLRA_EVENT_STAT_DISPATCHED 0
+#define CTLRA_EVENT_STAT_SLIDER_MERGED 1
+#define CTLRA_EVENT_STAT_ENCODER_MERGED 2
+#define CTLRA_EVENT_STAT_COUNT 3
+	uint32_t event_counts[CTLRA_EVENT_STAT_COUNT];
+	/* arrival time of the report being decoded, see event.h */
+	uint64_t event_timestamp;
+	struct ctlra_event_t event_batch[CTLRA_EVENT_BATCH_MAX];
+	struct ctlra_event_t *event_batch_ptrs[CTLRA_EVENT_BATCH_MAX];
 
 	/* Function pointers to poll events from device */
 	ctlra_dev_impl_poll poll;
+	ctlra_dev_impl_get_pollfds get_pollfds;
 	ctlra_dev_impl_disconnect disconnect;
 
 	/* Function pointers to write feedback to device */
 	ctlra_dev_impl_light_set light_set;
+	ctlra_dev_impl_lights_set_range lights_set_range;
 	ctlra_dev_impl_feedback_set feedback_set;
 	ctlra_dev_impl_feedback_digits feedback_digits;
 	ctlra_dev_impl_grid_light_set grid_light_set;
+	ctlra_dev_impl_grid_lights_set_frame grid_lights_set_frame;
 	ctlra_dev_impl_light_flush light_flush;
 	ctlra_dev_impl_usb_read_cb usb_read_cb;
 
@@ -200,12 +352,30 @@ typedef struct ctlra_dev_t *(*ctlra_dev_connect_func)(ctlra_event_func event_fun
 						    void *userdata,
 						    void *future);
 
+/** Passed as the *future* argument to a driver's connect() when the core
+ * has already located the USB device, either during the single bus scan
+ * in ctlra_probe() or from a hotplug event. Drivers hand *future* on to
+ * ctlra_dev_impl_usb_open() untouched. */
+struct ctlra_usb_probe_t {
+	struct ctlra_t *ctlra;
+	/* libusb_device *, valid for the duration of connect() */
+	void *usb_device;
+	/* libusb_device_handle * already opened, or NULL. Set to NULL by
+	 * ctlra_dev_impl_usb_open() when the device takes ownership */
+	void *usb_handle;
+};
+
 /** Opens the libusb handle for the given vid:pid.
- * Implementation in usb.c.
+ * Implementation in usb.c. If *future* is a ctlra_usb_probe_t the device
+ * it carries is used directly, otherwise the bus is enumerated.
+ * On success the device holds the transfer pool, so any later failure
+ * in connect() must go through ctlra_dev_impl_usb_close(). On failure
+ * nothing is held, and the driver only frees itself.
  * @retval 0 on Success
  * @retval -1 on Error
  * @retval -ENODEV when device not found */
-int ctlra_dev_impl_usb_open(struct ctlra_dev_t *dev, int vid, int pid);
+int ctlra_dev_impl_usb_open(struct ctlra_dev_t *dev, int vid, int pid,
+			    void *future);
 
 /** Opens the interface on a usb device. This allows controllers to make
  * multiple connections to interfaces, allowing access to screens, lights,
@@ -222,16 +392,68 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 				      uint32_t endpoint, uint8_t *data,
 				      uint32_t size);
 
-/** Writes bytes to the device using an interrupt USB transfer*/
+/** Keeps *count* interrupt reads of up to *size* bytes permanently in
+ * flight on *endpoint*. Each completed transfer is passed to the device's
+ * usb_read_cb, and then resubmitted from the completion callback, so the
+ * driver does not need to re-arm reads in poll(). Call after the
+ * interface has been opened and usb_read_cb has been set. Errors are
+ * reported here; the device can't deliver input, so drivers fail their
+ * connect on error.
+ * @retval 0 on Success
+ * @retval -EINVAL if *count* exceeds the in-flight read budget
+ * @retval -ENOSPC if the transfer pool is exhausted
+ * @retval -EIO on submission failure */
+#define CTLRA_USB_PERSISTENT_READS 4
+int ctlra_dev_impl_usb_interrupt_read_register(struct ctlra_dev_t *dev,
+					       uint32_t idx, uint32_t endpoint,
+					       uint32_t size, uint32_t count);
+
+/** Writes bytes to the device using an interrupt USB transfer. If the
+ * in-flight write limit is reached, the write is queued and sent when an
+ * earlier write completes. A newer write with the same report id (data[0])
+ * replaces a queued one, so the device converges to the latest state */
 int ctlra_dev_impl_usb_interrupt_write(struct ctlra_dev_t *dev, uint32_t idx,
 				       uint32_t endpoint, uint8_t *data,
 				       uint32_t size);
 
-/** Writes bytes to the device using a bulk USB transfer*/
+/** Same as ctlra_dev_impl_usb_interrupt_write(), with an explicit *key* to
+ * coalesce queued writes on. Use when several writes share a report id but
+ * carry different data, eg: segments of a screen */
+int ctlra_dev_impl_usb_interrupt_write_key(struct ctlra_dev_t *dev,
+					   uint32_t idx, uint32_t endpoint,
+					   uint8_t *data, uint32_t size,
+					   uint32_t key);
+
+/** Writes bytes to the device using a bulk USB transfer. Bulk writes have
+ * their own in-flight budget and queue, separate from interrupt writes.
+ * Queued writes with the same 4 byte header and size are coalesced */
 int ctlra_dev_impl_usb_bulk_write(struct ctlra_dev_t *dev, uint32_t idx,
 				  uint32_t endpoint, uint8_t *data,
 				  uint32_t size);
 
+/** Allocates the two *size* byte buffers of *fb*, for bulk transfers to
+ * *endpoint* on handle *idx*. The buffers are zeroed: drivers write their
+ * protocol header and footer into both fb->buf[] entries after init. The
+ * framebuffer is freed by ctlra_dev_impl_usb_close().
+ * @retval 0 on Success
+ * @retval -ENOMEM on allocation failure */
+int ctlra_dev_impl_usb_fb_init(struct ctlra_dev_t *dev,
+			       struct ctlra_usb_fb_t *fb,
+			       uint32_t idx, uint32_t endpoint,
+			       uint32_t size);
+
+/** Returns the buffer to render the next frame into */
+static inline uint8_t *
+ctlra_dev_impl_usb_fb_back(struct ctlra_usb_fb_t *fb)
+{
+	return fb->buf[fb->back];
+}
+
+/** Sends the back buffer to the device without copying it. If the
+ * previous frame is still in flight, the flush is deferred until it
+ * completes, and repeated flushes in that time are coalesced */
+int ctlra_dev_impl_usb_fb_flush(struct ctlra_usb_fb_t *fb);
+
 /** Close the USB device handles, returning them to the kernel */
 void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev);
 
@@ -242,6 +464,128 @@ void ctlra_dev_impl_banish(struct ctlra_dev_t *dev);
 /* IMPLEMENTATION DETAILS ONLY BELOW HERE */
 
 
+/** Writes *num* events to the ring, dropping (and counting) those that
+ * do not fit. Implementation in event.c
+ * @retval The number of events written */
+uint32_t ctlra_impl_event_ring_write(struct ctlra_event_ring_t *ring,
+				     const struct ctlra_event_t *events,
+				     uint32_t num);
+
+/** Sends all batched events of the device to the application in one
+ * callback, and empties the batch. Called by the core after each report
+ * is decoded, and after each poll, so drivers do not need to call it */
+void ctlra_dev_impl_event_flush(struct ctlra_dev_t *dev);
+
+/** Called by the core when a report is decoded. Flushes the batch,
+ * unless the device coalesces, whose batch is held until the end of
+ * ctlra_dev_poll() */
+static inline void
+ctlra_dev_impl_event_report_done(struct ctlra_dev_t *dev)
+{
+	if(!dev->event_coalesce)
+		ctlra_dev_impl_event_flush(dev);
+}
+
+/** Returns non-zero if the application subscribed to any control of
+ * *type*. Drivers use it to skip decoding a whole class of controls */
+static inline int
+ctlra_dev_impl_event_type_wanted(const struct ctlra_dev_t *dev,
+				 uint32_t type)
+{
+	if(type >= CTLRA_EVENT_T_COUNT)
+		return !!(dev->event_type_optional & CTLRA_EVENT_MASK(type));
+	return !(dev->event_type_skip & CTLRA_EVENT_MASK(type));
+}
+
+/** Returns non-zero if the application subscribed to control *id* of
+ * *type*. Drivers check it before decoding the control */
+static inline int
+ctlra_dev_impl_event_wanted(const struct ctlra_dev_t *dev, uint32_t type,
+			    uint32_t id)
+{
+	if(!ctlra_dev_impl_event_type_wanted(dev, type))
+		return 0;
+	if(type >= CTLRA_EVENT_T_COUNT || id >= CTLRA_EVENT_ID_MAX)
+		return 1;
+	return !(dev->event_ids_skip.ids[type][id / 32] & (1u << (id % 32)));
+}
+
+/** Merges *event* into a batched event of the same slider or encoder.
+ * Returns 1 if merged, 0 if the event must be appended. */
+int ctlra_dev_impl_event_merge(struct ctlra_dev_t *dev,
+			       const struct ctlra_event_t *event);
+
+/** Appends an event to the device's batch. Drivers call this for each
+ * control that changed while decoding a report. */
+static inline void
+ctlra_dev_impl_event_add(struct ctlra_dev_t *dev,
+			 const struct ctlra_event_t *event)
+{
+	/* drivers that don't check the subscription while decoding still
+	 * have unwanted events dropped here */
+	uint32_t id = event->type == CTLRA_EVENT_GRID ? event->grid.id :
+		      event->button.id;
+	if(!ctlra_dev_impl_event_wanted(dev, event->type, id))
+		return;
+	if(dev->event_coalesce && ctlra_dev_impl_event_merge(dev, event))
+		return;
+	if(dev->event_batch_count == CTLRA_EVENT_BATCH_MAX)
+		ctlra_dev_impl_event_flush(dev);
+	struct ctlra_event_t *e = &dev->event_batch[dev->event_batch_count++];
+	*e = *event;
+	e->timestamp = dev->event_timestamp;
+}
+
+/** Sends a CTLRA_EVENT_GRID_SNAPSHOT with the state of all pads of grid
+ * *id* if the application subscribed to it and any pad changed since the
+ * last one. Grid drivers call it once after decoding each pad report.
+ * *pressure* holds one value per pad up to
+ * CTLRA_GRID_SNAPSHOT_PRESSURE_MAX, or is NULL if the pads have none */
+static inline void
+ctlra_dev_impl_grid_snapshot(struct ctlra_dev_t *dev, uint32_t id,
+			     uint16_t pads, uint64_t pressed,
+			     const uint8_t *pressure)
+{
+	if(!ctlra_dev_impl_event_type_wanted(dev, CTLRA_EVENT_GRID_SNAPSHOT))
+		return;
+
+	struct ctlra_event_t event = {
+		.type = CTLRA_EVENT_GRID_SNAPSHOT,
+		.grid_snapshot = {
+			.id = id,
+			.pads = pads,
+			.pressed_lo = (uint32_t)pressed,
+			.pressed_hi = (uint32_t)(pressed >> 32),
+		},
+	};
+	struct ctlra_event_grid_snapshot_t *snap = &event.grid_snapshot;
+	if(pressure) {
+		uint32_t n = pads < CTLRA_GRID_SNAPSHOT_PRESSURE_MAX ? pads :
+			     CTLRA_GRID_SNAPSHOT_PRESSURE_MAX;
+		/* 4 bits of each pressure, see event.h */
+		for(uint32_t i = 0; i < n; i++)
+			snap->pressure[i / 2] |= (pressure[i] >> 4) << (4 * (i % 2));
+		snap->flags = CTLRA_EVENT_GRID_FLAG_PRESSURE;
+	}
+
+	if(memcmp(snap, &dev->grid_snapshot, sizeof(*snap)) == 0)
+		return;
+	dev->grid_snapshot = *snap;
+	ctlra_dev_impl_event_add(dev, &event);
+}
+
+/** Drops the core's record of *light_id*, for drivers that change a
+ * light themselves, such as pad feedback on a hit. The next
+ * ctlra_dev_light_set() of that light then reaches the driver, even if
+ * the app sets the same status as before */
+static inline void
+ctlra_dev_impl_light_shadow_invalidate(struct ctlra_dev_t *dev,
+				       uint32_t light_id)
+{
+	if(light_id < CTLRA_LIGHT_SHADOW_MAX)
+		dev->light_shadow_set[light_id / 32] &= ~(1u << (light_id % 32));
+}
+
 struct ctlra_t
 {
 	/* Options this instance was created with */
@@ -254,6 +598,15 @@ struct ctlra_t
 	/* USB backend context */
 	struct libusb_context *ctx;
 	uint8_t usb_initialized;
+	/* queue of hotplug events for idle_iter, see usb.c */
+	void *usb_hotplug;
+	/* identity of every device seen, for unique_id and removal */
+	void *identity;
+	/* I/O thread state if running, see ctlra.c */
+	void *io;
+	/* eventfd signalled when idle_iter has work not tied to a device
+	 * fd, returned by ctlra_get_pollfds() */
+	int wake_fd;
 
 	/* Linked list of devices currently in use */
 	struct ctlra_dev_t *dev_list;
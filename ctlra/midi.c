@@ -117,6 +117,16 @@ int ctlra_midi_output_write(struct ctlra_midi_t *s, uint8_t nbytes,
 	return nbytes;
 }
 
+int ctlra_midi_get_pollfds(struct ctlra_midi_t *s, struct pollfd *fds,
+			   uint32_t max)
+{
+	int count = snd_seq_poll_descriptors_count(s->seq, POLLIN);
+	if(count <= 0 || max == 0)
+		return count;
+	snd_seq_poll_descriptors(s->seq, fds, max, POLLIN);
+	return count;
+}
+
 int ctlra_midi_input_poll(struct ctlra_midi_t *s)
 {
 	int res;
@@ -53,6 +53,12 @@ void ctlra_midi_destroy(struct ctlra_midi_t *s);
 int ctlra_midi_output_write(struct ctlra_midi_t *s, uint8_t nbytes,
                             uint8_t * buffer);
 
+/** Fill *fds* with the ALSA sequencer fds that become readable when
+ * input is pending. Returns the number of fds, at most *max* are written */
+struct pollfd;
+int ctlra_midi_get_pollfds(struct ctlra_midi_t *s, struct pollfd *fds,
+			   uint32_t max);
+
 /** Call this to poll for input. This results in the callback getting
  * called once for each input event */
 int ctlra_midi_input_poll(struct ctlra_midi_t *s);
@@ -0,0 +1,70 @@
+#include <string.h>
+
+#include "palette.h"
+
+/* Scale a colour so its brightest channel is 255, leaving only hue and
+ * saturation. Black becomes white */
+static void ctlra_palette_chroma(int32_t *c)
+{
+	int32_t max = c[0] > c[1] ? c[0] : c[1];
+	max = c[2] > max ? c[2] : max;
+	if(max == 0) {
+		c[0] = c[1] = c[2] = 255;
+		return;
+	}
+	for(int i = 0; i < 3; i++)
+		c[i] = c[i] * 255 / max;
+}
+
+static void ctlra_palette_split(uint32_t rgb, int32_t *c)
+{
+	c[0] = (rgb >> 16) & 0xFF;
+	c[1] = (rgb >>  8) & 0xFF;
+	c[2] = (rgb >>  0) & 0xFF;
+}
+
+void ctlra_palette_init(struct ctlra_palette_t *pal,
+			const struct ctlra_palette_entry_t *entries,
+			uint32_t count,
+			uint32_t flags)
+{
+	memset(pal->lut, 0, sizeof(pal->lut));
+	if(!entries || count == 0)
+		return;
+
+	const uint32_t steps = 1 << CTLRA_PALETTE_LUT_BITS;
+	const uint32_t width = 256 / steps;
+
+	for(uint32_t i = 0; i < CTLRA_PALETTE_LUT_SIZE; i++) {
+		/* centre of the cell in 8 bit per channel space */
+		int32_t cell[3] = {
+			((i >> (2 * CTLRA_PALETTE_LUT_BITS)) % steps) * width,
+			((i >> CTLRA_PALETTE_LUT_BITS) % steps) * width,
+			(i % steps) * width,
+		};
+		for(int c = 0; c < 3; c++)
+			cell[c] += width / 2;
+		if(flags & CTLRA_PALETTE_CHROMA)
+			ctlra_palette_chroma(cell);
+
+		uint32_t best = 0;
+		int32_t best_dist = INT32_MAX;
+		for(uint32_t e = 0; e < count; e++) {
+			int32_t col[3];
+			ctlra_palette_split(entries[e].rgb, col);
+			if(flags & CTLRA_PALETTE_CHROMA)
+				ctlra_palette_chroma(col);
+
+			int32_t dist = 0;
+			for(int c = 0; c < 3; c++) {
+				int32_t d = cell[c] - col[c];
+				dist += d * d;
+			}
+			if(dist < best_dist) {
+				best_dist = dist;
+				best = e;
+			}
+		}
+		pal->lut[i] = entries[best].code;
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef CTLRA_PALETTE_H
+#define CTLRA_PALETTE_H
+
+#include <stdint.h>
+
+/* Maps ctlra light status colours (0xRRGGBB in the low 24 bits) to the
+ * code a device uses for the nearest colour it can show. Drivers declare
+ * their hardware palette as a table of entries, and build the lookup
+ * table once at connect time: a lookup is then a single table load.
+ *
+ * The table has 4 bits per channel, 16x16x16 cells. Each cell holds the
+ * code of the palette entry nearest to the centre of that cell.
+ */
+
+#define CTLRA_PALETTE_LUT_BITS 4
+#define CTLRA_PALETTE_LUT_SIZE (1 << (3 * CTLRA_PALETTE_LUT_BITS))
+
+/* Match on hue and saturation only: cells and entries are scaled to full
+ * intensity before comparing, as the devices set brightness separately.
+ * Black cells match as white, like an uncoloured light. */
+#define CTLRA_PALETTE_CHROMA (1 << 0)
+
+struct ctlra_palette_entry_t {
+	/* colour shown by the device, as 0xRRGGBB */
+	uint32_t rgb;
+	/* the code the device expects for that colour */
+	uint8_t code;
+};
+
+struct ctlra_palette_t {
+	uint8_t lut[CTLRA_PALETTE_LUT_SIZE];
+};
+
+/** Build the lookup table of *pal* from *count* entries. Takes a few
+ * hundred microseconds, call it when the device is probed and not from
+ * the light set path. */
+void ctlra_palette_init(struct ctlra_palette_t *pal,
+			const struct ctlra_palette_entry_t *entries,
+			uint32_t count,
+			uint32_t flags);
+
+/** Returns the palette code for the colour of *light_status* */
+static inline uint8_t
+ctlra_palette_code(const struct ctlra_palette_t *pal, uint32_t light_status)
+{
+	uint32_t idx = ((light_status >> 12) & 0xf00) |
+		       ((light_status >>  8) & 0x0f0) |
+		       ((light_status >>  4) & 0x00f);
+	return pal->lut[idx];
+}
+
+/** Quantize the 7 bit brightness of *light_status* to *levels* steps,
+ * returning 0 to *levels* - 1. For mono LEDs with few brightness steps */
+static inline uint8_t
+ctlra_palette_level(uint32_t light_status, uint32_t levels)
+{
+	return (((light_status >> 24) & 0x7F) * levels) >> 7;
+}
+
+#endif /* CTLRA_PALETTE_H */
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "impl.h"
 
@@ -14,6 +16,11 @@
 #define CTLRA_USE_ASYNC_XFER 1
 #define CTLRA_ASYNC_READ_MAX 10
 
+/* libusb_dev_mem_alloc() was added in libusb 1.0.21 */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define CTLRA_USB_HAVE_DEV_MEM 1
+#endif
+
 #ifndef LIBUSB_HOTPLUG_MATCH_ANY
 #define LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT 0xcafe
 #define LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED 0xcafe
@@ -29,73 +36,352 @@ int libusb_set_auto_detach_kernel_driver() {return 0xcafe;}
 
 /* From cltra.c */
 extern int ctlra_impl_get_id_by_vid_pid(uint32_t vid, uint32_t pid);
-extern int ctlra_impl_accept_dev(struct ctlra_t *ctlra, int dev_id);
+extern int ctlra_impl_accept_dev(struct ctlra_t *ctlra, int dev_id,
+				 void *future);
+extern int ctlra_impl_accept_connected(struct ctlra_t *ctlra,
+				       struct ctlra_dev_t *dev);
 extern int ctlra_impl_dev_get_by_vid_pid(struct ctlra_t *ctlra, int32_t vid,
 					 int32_t pid, struct ctlra_dev_t **out_dev);
 
+/* Each device owns a pool of preallocated async transfers, so the
+ * steady-state read and write paths never touch the heap. Interrupt
+ * transfers have a fixed size buffer, while bulk transfers (screens) grow
+ * their buffer on first use, and keep it for the lifetime of the device */
+#define CTLRA_USB_POOL_INT_COUNT (CTLRA_ASYNC_READ_MAX * 2)
+#define CTLRA_USB_POOL_INT_SIZE  1024
+#define CTLRA_USB_POOL_BULK_COUNT 4
+
+/* Writes are scheduled on two lanes, each with its own in-flight budget
+ * and pending queue: small interrupt writes (LEDs) and large bulk writes
+ * (screens). Streaming screens can not starve LED feedback, and write
+ * completions always service the interrupt lane before the bulk lane */
+#define USB_LANE_INT   0
+#define USB_LANE_BULK  1
+#define USB_LANE_COUNT 2
+
+static const struct usb_lane_info_t {
+	uint32_t inflight_max;
+	uint8_t stat_write;
+	uint8_t stat_inflight;
+	uint8_t stat_error;
+	uint8_t stat_coalesced;
+	uint8_t stat_latency;
+} usb_lanes[USB_LANE_COUNT] = {
+	[USB_LANE_INT] = {
+		.inflight_max   = CTLRA_ASYNC_READ_MAX,
+		.stat_write     = USB_XFER_INT_WRITE,
+		.stat_inflight  = USB_XFER_INFLIGHT_WRITE,
+		.stat_error     = USB_XFER_ERROR,
+		.stat_coalesced = USB_XFER_COALESCED,
+		.stat_latency   = USB_XFER_INT_LATENCY_MAX,
+	},
+	[USB_LANE_BULK] = {
+		.inflight_max   = CTLRA_USB_POOL_BULK_COUNT,
+		.stat_write     = USB_XFER_BULK_WRITE,
+		.stat_inflight  = USB_XFER_INFLIGHT_BULK,
+		.stat_error     = USB_XFER_BULK_ERROR,
+		.stat_coalesced = USB_XFER_BULK_COALESCED,
+		.stat_latency   = USB_XFER_BULK_LATENCY_MAX,
+	},
+};
+
 /* struct to track async USB transfers */
 struct usb_async_t {
+	/* next free async in the pool, only valid while not in flight */
 	struct usb_async_t *next;
-	struct usb_async_t *prev;
+	struct ctlra_dev_t *dev;
 	struct libusb_transfer *xfer;
-	char malloc_mem[0];
+	uint8_t *buf;
+	uint32_t buf_size;
+	/* bulk asyncs are only used on the bulk lane */
+	uint8_t bulk;
+	uint8_t in_flight;
+	/* persistent reads are resubmitted from their completion callback */
+	uint8_t persistent;
+	/* time the write was requested by the driver, for lane latency */
+	uint64_t t_queued;
 };
 
-#include <assert.h>
+/* Writes that could not be submitted as the lane's in-flight limit was
+ * reached. Writes with the same key and size (by default the report id
+ * for interrupt writes) replace the queued payload, so only the latest
+ * state is sent once a write completes. Entries are submitted in order of
+ * queueing from the write completion callback */
+#define CTLRA_USB_PENDING_MAX 8
+struct usb_pending_t {
+	/* order of queueing, 0 when unused */
+	uint32_t seq;
+	uint32_t idx;
+	uint32_t endpoint;
+	uint32_t key;
+	uint32_t size;
+	uint64_t t_queued;
+	/* payload, swapped with the async buffer on submit */
+	uint8_t *data;
+	uint32_t data_size;
+};
+
+struct usb_lane_t {
+	uint32_t pending_count;
+	uint32_t pending_seq;
+	struct usb_pending_t pending[CTLRA_USB_PENDING_MAX];
+};
 
-static inline int __attribute__ ((unused))
-ctlra_usb_impl_xfer_validate(struct ctlra_dev_t *dev)
+struct usb_pool_t {
+	struct usb_async_t *free_int;
+	struct usb_async_t *free_bulk;
+	uint32_t in_use;
+	struct usb_lane_t lane[USB_LANE_COUNT];
+	struct usb_async_t async[CTLRA_USB_POOL_INT_COUNT +
+				 CTLRA_USB_POOL_BULK_COUNT];
+	uint8_t int_mem[(CTLRA_USB_POOL_INT_COUNT + CTLRA_USB_PENDING_MAX) *
+			CTLRA_USB_POOL_INT_SIZE];
+};
+
+#define CTLRA_USB_POOL_TOTAL (CTLRA_USB_POOL_INT_COUNT + \
+			      CTLRA_USB_POOL_BULK_COUNT)
+
+static int ctlra_usb_impl_pool_init(struct ctlra_dev_t *dev)
 {
-	struct ctlra_t *c = dev->ctlra_context;
-	struct usb_async_t *current = dev->usb_async_next;
+	if(dev->usb_pool)
+		return 0;
+
+	struct usb_pool_t *pool = calloc(1, sizeof(struct usb_pool_t));
+	if(!pool)
+		return -ENOMEM;
+
+	for(int i = 0; i < CTLRA_USB_POOL_TOTAL; i++) {
+		struct usb_async_t *async = &pool->async[i];
+		async->dev = dev;
+		async->xfer = libusb_alloc_transfer(0);
+		if(!async->xfer)
+			goto fail;
 
-	int i = 0;
-	while(current) {
-		printf("i = %d, async = %p, next %p\n", i, current, current->next);
-		assert(current != current->next);
-		current = current->next;
-		i++;
+		if(i < CTLRA_USB_POOL_INT_COUNT) {
+			async->buf = &pool->int_mem[i * CTLRA_USB_POOL_INT_SIZE];
+			async->buf_size = CTLRA_USB_POOL_INT_SIZE;
+			async->next = pool->free_int;
+			pool->free_int = async;
+		} else {
+			async->bulk = 1;
+			async->next = pool->free_bulk;
+			pool->free_bulk = async;
+		}
+	}
+
+	/* interrupt pending payloads live after the async buffers */
+	struct usb_lane_t *lane = &pool->lane[USB_LANE_INT];
+	for(int i = 0; i < CTLRA_USB_PENDING_MAX; i++) {
+		int mem_idx = CTLRA_USB_POOL_INT_COUNT + i;
+		lane->pending[i].data =
+			&pool->int_mem[mem_idx * CTLRA_USB_POOL_INT_SIZE];
+		lane->pending[i].data_size = CTLRA_USB_POOL_INT_SIZE;
 	}
-	CTLRA_DRIVER(c, "validate done, count = %d\n", i);
-	return i;
+
+	dev->usb_pool = pool;
+	return 0;
+fail:
+	for(int i = 0; i < CTLRA_USB_POOL_TOTAL; i++)
+		if(pool->async[i].xfer)
+			libusb_free_transfer(pool->async[i].xfer);
+	free(pool);
+	return -ENOMEM;
 }
 
-#ifdef XFER_VALIDATE_DEBUG
-#define XFER_VALIDATE(dev)						\
-	printf("from %s, %d\n", __func__, __LINE__);			\
-	ctlra_usb_impl_xfer_validate(dev)
-#else
-#define XFER_VALIDATE(dev)
-#endif
+/* Returns a free async with a buffer of at least *size* bytes, or NULL
+ * if the pool is exhausted. Bulk buffers are only allocated the first time
+ * a larger transfer is requested, steady state reuses them */
+static struct usb_async_t *
+ctlra_usb_impl_pool_get(struct ctlra_dev_t *dev, uint8_t bulk, uint32_t size)
+{
+	struct usb_pool_t *pool = dev->usb_pool;
+	if(!pool)
+		return 0;
+
+	struct usb_async_t **head = bulk ? &pool->free_bulk : &pool->free_int;
+	struct usb_async_t *async = *head;
+	if(!async)
+		return 0;
+
+	if(size > async->buf_size) {
+		if(!bulk)
+			return 0;
+		uint8_t *buf = realloc(async->buf, size);
+		if(!buf)
+			return 0;
+		async->buf = buf;
+		async->buf_size = size;
+	}
+
+	*head = async->next;
+	async->next = 0;
+	async->in_flight = 1;
+
+	pool->in_use++;
+	if(pool->in_use > dev->usb_xfer_counts[USB_XFER_POOL_HWM])
+		dev->usb_xfer_counts[USB_XFER_POOL_HWM] = pool->in_use;
+
+	return async;
+}
+
+static void ctlra_usb_impl_pool_put(struct usb_async_t *async)
+{
+	struct usb_pool_t *pool = async->dev->usb_pool;
+	struct usb_async_t **head = async->bulk ? &pool->free_bulk :
+						  &pool->free_int;
+	async->in_flight = 0;
+	async->persistent = 0;
+	async->next = *head;
+	*head = async;
+	pool->in_use--;
+}
+
+static void ctlra_usb_impl_pool_free(struct ctlra_dev_t *dev)
+{
+	struct ctlra_t *c = dev->ctlra_context;
+	struct usb_pool_t *pool = dev->usb_pool;
+	if(!pool)
+		return;
+
+	/* libusb still owns in-flight transfers: leaking the pool is
+	 * better than a use-after-free in a late completion callback */
+	if(pool->in_use) {
+		CTLRA_WARN(c, "[%s] %d usb transfers still in flight, leaking pool\n",
+			   dev->info.device, pool->in_use);
+		dev->usb_pool = 0;
+		return;
+	}
+
+	for(int i = 0; i < CTLRA_USB_POOL_TOTAL; i++) {
+		libusb_free_transfer(pool->async[i].xfer);
+		if(pool->async[i].bulk)
+			free(pool->async[i].buf);
+	}
+	for(int i = 0; i < CTLRA_USB_PENDING_MAX; i++)
+		free(pool->lane[USB_LANE_BULK].pending[i].data);
+	free(pool);
+	dev->usb_pool = 0;
+}
 
 static inline void
 ctlra_usb_impl_xfer_release(struct ctlra_dev_t *dev)
 {
 	struct ctlra_t *c = dev->ctlra_context;
-	struct usb_async_t *current = dev->usb_async_next;
+	struct usb_pool_t *pool = dev->usb_pool;
+	if(!pool)
+		return;
 
-	int i = 0;
-	while(current) {
-		CTLRA_DRIVER(c, "async free %d : %p\n", i, current);
-		int ret = libusb_cancel_transfer(current->xfer);
+	for(int i = 0; i < CTLRA_USB_POOL_TOTAL; i++) {
+		struct usb_async_t *async = &pool->async[i];
+		if(!async->in_flight)
+			continue;
+
+		CTLRA_DRIVER(c, "async cancel %d : %p\n", i, async);
+		int ret = libusb_cancel_transfer(async->xfer);
 		if(ret) {
 			CTLRA_ERROR(c, "usb cancel xfer failed: %s, async %p\n",
-				    libusb_strerror(ret), current);
+				    libusb_strerror(ret), async);
+			continue;
 		}
 		dev->usb_xfer_counts[USB_XFER_INFLIGHT_CANCEL]++;
+	}
 
-		if(current == current->next) {
-			CTLRA_ERROR(c, "list corrupt, cur %p == cur->next %p\n",
-				    current, current->next);
-			break;
+	for(struct ctlra_usb_fb_t *fb = dev->usb_fb_list; fb; fb = fb->next) {
+		fb->flush_pending = 0;
+		if(!fb->in_flight)
+			continue;
+		int ret = libusb_cancel_transfer(fb->xfer);
+		if(ret) {
+			CTLRA_ERROR(c, "usb cancel fb xfer failed: %s, fb %p\n",
+				    libusb_strerror(ret), fb);
+			continue;
 		}
+		dev->usb_xfer_counts[USB_XFER_INFLIGHT_CANCEL]++;
+	}
+}
 
-		current = current->next;
-		/* todo fixme */
-		if(!current || i > 10000)
-			break;
-		i++;
+static inline void
+ctlra_usb_impl_latency(struct ctlra_dev_t *dev, uint32_t lane_idx,
+		       uint64_t t_queued)
+{
+	const int lat_idx = usb_lanes[lane_idx].stat_latency;
+	uint64_t lat = ctlra_impl_time_ns() - t_queued;
+	uint32_t lat_us = lat / 1000;
+	if(lat_us > dev->usb_xfer_counts[lat_idx])
+		dev->usb_xfer_counts[lat_idx] = lat_us;
+}
+
+static struct usb_pending_t *
+ctlra_usb_impl_pending_find(struct usb_lane_t *lane, uint32_t idx,
+			    uint32_t endpoint, uint32_t key, uint32_t size)
+{
+	if(!lane->pending_count)
+		return 0;
+	for(int i = 0; i < CTLRA_USB_PENDING_MAX; i++) {
+		struct usb_pending_t *p = &lane->pending[i];
+		if(p->seq && p->idx == idx && p->endpoint == endpoint &&
+		   p->key == key && p->size == size)
+			return p;
+	}
+	return 0;
+}
+
+/* Queues a write to be submitted when an in-flight write on the same
+ * lane completes. Returns size if the write was queued or replaced a
+ * pending one */
+static int
+ctlra_usb_impl_pending_add(struct ctlra_dev_t *dev, uint32_t lane_idx,
+			   uint32_t idx, uint32_t endpoint, uint32_t key,
+			   uint8_t *data, uint32_t size, uint64_t t_queued)
+{
+	const struct usb_lane_info_t *info = &usb_lanes[lane_idx];
+	struct usb_pool_t *pool = dev->usb_pool;
+	struct usb_lane_t *lane = &pool->lane[lane_idx];
+
+	struct usb_pending_t *p = ctlra_usb_impl_pending_find(lane, idx,
+							      endpoint, key,
+							      size);
+	if(p) {
+		/* latest wins: keep queue position, replace the payload */
+		dev->usb_xfer_counts[info->stat_coalesced]++;
+	} else {
+		for(int i = 0; i < CTLRA_USB_PENDING_MAX; i++) {
+			if(!lane->pending[i].seq) {
+				p = &lane->pending[i];
+				break;
+			}
+		}
+		if(!p) {
+			dev->usb_xfer_counts[info->stat_error]++;
+			return 0;
+		}
+	}
+
+	/* bulk payloads are allocated on first use, and kept */
+	if(size > p->data_size) {
+		uint8_t *mem = 0;
+		if(lane_idx == USB_LANE_BULK)
+			mem = realloc(p->data, size);
+		if(!mem) {
+			dev->usb_xfer_counts[info->stat_error]++;
+			return -ENOSPC;
+		}
+		p->data = mem;
+		p->data_size = size;
 	}
+
+	if(!p->seq) {
+		p->seq = ++lane->pending_seq;
+		p->idx = idx;
+		p->endpoint = endpoint;
+		p->key = key;
+		p->t_queued = t_queued;
+		lane->pending_count++;
+	}
+
+	memcpy(p->data, data, size);
+	p->size = size;
+	return size;
 }
 
 static int ctlra_usb_impl_get_serial(struct libusb_device_handle *handle,
@@ -115,6 +401,446 @@ static int ctlra_usb_impl_get_serial(struct libusb_device_handle *handle,
 	return -1;
 }
 
+/* Resume cache: the light shadow, and the last frame of each screen, of
+ * a device when it was unbound. Kept per identity, so that a unit that
+ * drops off the bus and returns within resume_grace_ms gets its feedback
+ * back in one round of transfers, without waiting on the app */
+#define CTLRA_USB_RESUME_FBS 4
+
+struct usb_resume_fb_t {
+	uint8_t idx;
+	uint8_t endpoint;
+	uint32_t size;
+	uint32_t data_size;
+	uint8_t *data;
+};
+
+struct usb_resume_t {
+	uint64_t t_left;
+	uint32_t light_shadow[CTLRA_LIGHT_SHADOW_MAX];
+	uint32_t light_shadow_set[CTLRA_LIGHT_SHADOW_MAX / 32];
+	uint32_t fb_count;
+	struct usb_resume_fb_t fb[CTLRA_USB_RESUME_FBS];
+};
+
+/* Identity map: every device seen by this instance gets an entry, which
+ * is kept after it leaves so that a returning controller is given its
+ * previous unique_id. Entries are indexed twice:
+ * - by bus location (bus + port path), to find the one instance a hotplug
+ *   departure refers to, as a removed device can no longer be queried
+ * - by VID:PID + serial, to recognise a device plugged into a new port
+ * Both indexes are open addressed, storing the entry index + 1. */
+struct usb_identity_t {
+	uint32_t unique_id;
+	uint32_t vid;
+	uint32_t pid;
+	uint8_t bus;
+	uint8_t port_count;
+	uint8_t ports[CTLRA_USB_PORTS_MAX];
+	char serial[CTLRA_DEV_SERIAL_MAX];
+	/* instance currently using this identity, or NULL */
+	struct ctlra_dev_t *dev;
+	/* last state sent, when resume_grace_ms is set */
+	struct usb_resume_t *resume;
+};
+
+struct usb_identity_map_t {
+	uint32_t count;
+	uint32_t capacity;
+	struct usb_identity_t *entries;
+	/* both indexes have 2 * capacity slots */
+	uint32_t *by_loc;
+	uint32_t *by_serial;
+};
+
+static uint32_t usb_identity_fnv(uint32_t h, const void *data, uint32_t size)
+{
+	const uint8_t *d = data;
+	for(uint32_t i = 0; i < size; i++)
+		h = (h ^ d[i]) * 16777619u;
+	return h;
+}
+
+static uint32_t usb_identity_loc_hash(uint8_t bus, uint8_t port_count,
+				      const uint8_t *ports)
+{
+	uint32_t h = usb_identity_fnv(2166136261u, &bus, 1);
+	h = usb_identity_fnv(h, &port_count, 1);
+	return usb_identity_fnv(h, ports, port_count);
+}
+
+static uint32_t usb_identity_serial_hash(uint32_t vid, uint32_t pid,
+					 const char *serial)
+{
+	uint32_t h = usb_identity_fnv(2166136261u, &vid, sizeof(vid));
+	h = usb_identity_fnv(h, &pid, sizeof(pid));
+	return usb_identity_fnv(h, serial, strnlen(serial,
+						   CTLRA_DEV_SERIAL_MAX));
+}
+
+static void usb_identity_index_insert(struct usb_identity_map_t *map,
+				      uint32_t *index, uint32_t hash,
+				      uint32_t entry)
+{
+	uint32_t mask = map->capacity * 2 - 1;
+	uint32_t h = hash & mask;
+	while(index[h])
+		h = (h + 1) & mask;
+	index[h] = entry + 1;
+}
+
+static void usb_identity_reindex(struct usb_identity_map_t *map)
+{
+	uint32_t slots = map->capacity * 2;
+	memset(map->by_loc, 0, slots * sizeof(uint32_t));
+	memset(map->by_serial, 0, slots * sizeof(uint32_t));
+	for(uint32_t i = 0; i < map->count; i++) {
+		struct usb_identity_t *e = &map->entries[i];
+		if(e->port_count)
+			usb_identity_index_insert(map, map->by_loc,
+				usb_identity_loc_hash(e->bus, e->port_count,
+						      e->ports), i);
+		if(e->serial[0])
+			usb_identity_index_insert(map, map->by_serial,
+				usb_identity_serial_hash(e->vid, e->pid,
+							 e->serial), i);
+	}
+}
+
+static int usb_identity_grow(struct usb_identity_map_t *map)
+{
+	uint32_t capacity = map->capacity ? map->capacity * 2 : 16;
+	struct usb_identity_t *entries = realloc(map->entries,
+					capacity * sizeof(*entries));
+	if(!entries)
+		return -ENOMEM;
+	map->entries = entries;
+
+	uint32_t *by_loc = calloc(capacity * 2, sizeof(uint32_t));
+	uint32_t *by_serial = calloc(capacity * 2, sizeof(uint32_t));
+	if(!by_loc || !by_serial) {
+		free(by_loc);
+		free(by_serial);
+		return -ENOMEM;
+	}
+	free(map->by_loc);
+	free(map->by_serial);
+	map->by_loc = by_loc;
+	map->by_serial = by_serial;
+	map->capacity = capacity;
+	usb_identity_reindex(map);
+	return 0;
+}
+
+/* Find the entry at a bus location, that is (or is not) in use */
+static struct usb_identity_t *
+usb_identity_find_loc(struct usb_identity_map_t *map, uint8_t bus,
+		      uint8_t port_count, const uint8_t *ports, int bound)
+{
+	if(!map->capacity || !port_count)
+		return 0;
+	uint32_t mask = map->capacity * 2 - 1;
+	uint32_t h = usb_identity_loc_hash(bus, port_count, ports) & mask;
+	for(; map->by_loc[h]; h = (h + 1) & mask) {
+		struct usb_identity_t *e = &map->entries[map->by_loc[h] - 1];
+		if(e->bus == bus && e->port_count == port_count &&
+		   memcmp(e->ports, ports, port_count) == 0 &&
+		   (e->dev != 0) == bound)
+			return e;
+	}
+	return 0;
+}
+
+/* Find an unused entry for a device with this VID:PID and serial */
+static struct usb_identity_t *
+usb_identity_find_serial(struct usb_identity_map_t *map, uint32_t vid,
+			 uint32_t pid, const char *serial)
+{
+	if(!map->capacity || !serial[0])
+		return 0;
+	uint32_t mask = map->capacity * 2 - 1;
+	uint32_t h = usb_identity_serial_hash(vid, pid, serial) & mask;
+	for(; map->by_serial[h]; h = (h + 1) & mask) {
+		struct usb_identity_t *e = &map->entries[map->by_serial[h] - 1];
+		if(e->vid == vid && e->pid == pid && !e->dev &&
+		   strncmp(e->serial, serial, CTLRA_DEV_SERIAL_MAX) == 0)
+			return e;
+	}
+	return 0;
+}
+
+int ctlra_impl_usb_identity_bind(struct ctlra_t *ctlra,
+				 struct ctlra_dev_t *dev)
+{
+	/* MIDI, virtual and other non-USB devices have neither, so a
+	 * returning one can't be recognised: they get no identity, rather
+	 * than a new entry on every connect that is never reused */
+	if(!dev->info.serial[0] && !dev->usb_port_count) {
+		dev->identity = 0;
+		dev->info.unique_id = 0;
+		return 0;
+	}
+
+	struct usb_identity_map_t *map = ctlra->identity;
+	if(!map) {
+		map = calloc(1, sizeof(*map));
+		if(!map)
+			return -ENOMEM;
+		ctlra->identity = map;
+	}
+
+	const struct ctlra_dev_info_t *info = &dev->info;
+	struct usb_identity_t *e;
+
+	/* A serial identifies the device wherever it is plugged in, else
+	 * fall back to a serial-less device seen at the same location */
+	if(info->serial[0]) {
+		e = usb_identity_find_serial(map, info->vendor_id,
+					     info->device_id, info->serial);
+	} else {
+		e = usb_identity_find_loc(map, dev->usb_bus,
+					  dev->usb_port_count,
+					  dev->usb_ports, 0);
+		if(e && (e->vid != info->vendor_id ||
+			 e->pid != info->device_id || e->serial[0]))
+			e = 0;
+	}
+
+	if(e) {
+		int moved = e->bus != dev->usb_bus ||
+			    e->port_count != dev->usb_port_count ||
+			    memcmp(e->ports, dev->usb_ports,
+				   dev->usb_port_count) != 0;
+		if(moved) {
+			e->bus = dev->usb_bus;
+			e->port_count = dev->usb_port_count;
+			memcpy(e->ports, dev->usb_ports, dev->usb_port_count);
+			usb_identity_reindex(map);
+		}
+	} else {
+		if(map->count == map->capacity && usb_identity_grow(map))
+			return -ENOMEM;
+		uint32_t idx = map->count++;
+		e = &map->entries[idx];
+		memset(e, 0, sizeof(*e));
+		e->unique_id = map->count;
+		e->vid = info->vendor_id;
+		e->pid = info->device_id;
+		e->bus = dev->usb_bus;
+		e->port_count = dev->usb_port_count;
+		memcpy(e->ports, dev->usb_ports, dev->usb_port_count);
+		strncpy(e->serial, info->serial, CTLRA_DEV_SERIAL_MAX - 1);
+		if(e->port_count)
+			usb_identity_index_insert(map, map->by_loc,
+				usb_identity_loc_hash(e->bus, e->port_count,
+						      e->ports), idx);
+		if(e->serial[0])
+			usb_identity_index_insert(map, map->by_serial,
+				usb_identity_serial_hash(e->vid, e->pid,
+							 e->serial), idx);
+	}
+
+	e->dev = dev;
+	dev->identity = (e - map->entries) + 1;
+	dev->info.unique_id = e->unique_id;
+	return 0;
+}
+
+static void ctlra_usb_impl_resume_free(struct usb_resume_t *r)
+{
+	if(!r)
+		return;
+	for(uint32_t i = 0; i < r->fb_count; i++)
+		free(r->fb[i].data);
+	free(r);
+}
+
+static void ctlra_usb_impl_resume_clear(struct usb_resume_t *r)
+{
+	/* allocations are kept, for reuse by the next snapshot */
+	memset(r->light_shadow_set, 0, sizeof(r->light_shadow_set));
+	for(uint32_t i = 0; i < r->fb_count; i++)
+		r->fb[i].size = 0;
+}
+
+/* Copies the last flushed frame of each screen, and the light shadow, of
+ * a device that is going away. Runs once, before the driver frees them */
+static void ctlra_usb_impl_resume_snapshot(struct usb_resume_t *r,
+					   struct ctlra_dev_t *dev)
+{
+	memcpy(r->light_shadow, dev->light_shadow, sizeof(r->light_shadow));
+	memcpy(r->light_shadow_set, dev->light_shadow_set,
+	       sizeof(r->light_shadow_set));
+
+	for(uint32_t i = 0; i < r->fb_count; i++)
+		r->fb[i].size = 0;
+	for(struct ctlra_usb_fb_t *fb = dev->usb_fb_list; fb; fb = fb->next) {
+		if(!fb->flushed)
+			continue;
+		struct usb_resume_fb_t *f = 0;
+		for(uint32_t i = 0; i < r->fb_count; i++) {
+			if(r->fb[i].idx == fb->idx &&
+			   r->fb[i].endpoint == fb->endpoint) {
+				f = &r->fb[i];
+				break;
+			}
+		}
+		if(!f) {
+			if(r->fb_count == CTLRA_USB_RESUME_FBS)
+				break;
+			f = &r->fb[r->fb_count++];
+			f->idx = fb->idx;
+			f->endpoint = fb->endpoint;
+		}
+		if(f->data_size < fb->size) {
+			uint8_t *d = realloc(f->data, fb->size);
+			if(!d)
+				continue;
+			f->data = d;
+			f->data_size = fb->size;
+		}
+		memcpy(f->data, fb->buf[fb->flushed - 1], fb->size);
+		f->size = fb->size;
+	}
+}
+
+void ctlra_impl_usb_identity_unbind(struct ctlra_t *ctlra,
+				    struct ctlra_dev_t *dev)
+{
+	struct usb_identity_map_t *map = ctlra->identity;
+	if(!map || !dev->identity || dev->identity > map->count)
+		return;
+	struct usb_identity_t *e = &map->entries[dev->identity - 1];
+	if(e->dev == dev)
+		e->dev = 0;
+	if(ctlra->opts.resume_grace_ms) {
+		if(!e->resume)
+			e->resume = calloc(1, sizeof(struct usb_resume_t));
+		if(e->resume) {
+			ctlra_usb_impl_resume_snapshot(e->resume, dev);
+			e->resume->t_left = ctlra_impl_time_ns();
+		}
+	}
+	dev->identity = 0;
+}
+
+void ctlra_impl_usb_resume(struct ctlra_t *ctlra, struct ctlra_dev_t *dev)
+{
+	struct usb_identity_map_t *map = ctlra->identity;
+	if(!ctlra->opts.resume_grace_ms || !map || !dev->identity)
+		return;
+	struct usb_resume_t *r = map->entries[dev->identity - 1].resume;
+	if(!r || !r->t_left)
+		return;
+
+	uint64_t away = ctlra_impl_time_ns() - r->t_left;
+	r->t_left = 0;
+	if(away > ctlra->opts.resume_grace_ms * 1000000ull) {
+		ctlra_usb_impl_resume_clear(r);
+		return;
+	}
+
+	/* The lights go through the driver and one forced flush, which
+	 * sends every report in the order the device needs. Everything
+	 * queues on the lanes as usual, costing one round of transfers */
+	uint32_t lights = 0;
+	uint32_t frames = 0;
+	for(uint32_t i = 0; i < CTLRA_LIGHT_SHADOW_MAX; i++) {
+		if(!(r->light_shadow_set[i / 32] & (1u << (i % 32))))
+			continue;
+		ctlra_dev_light_set(dev, i, r->light_shadow[i]);
+		lights++;
+	}
+	if(lights)
+		ctlra_dev_light_flush(dev, 1);
+
+	for(uint32_t i = 0; i < r->fb_count; i++) {
+		struct usb_resume_fb_t *f = &r->fb[i];
+		if(!f->size)
+			continue;
+		for(struct ctlra_usb_fb_t *fb = dev->usb_fb_list; fb;
+		    fb = fb->next) {
+			if(fb->idx != f->idx || fb->endpoint != f->endpoint ||
+			   fb->size != f->size)
+				continue;
+			memcpy(ctlra_dev_impl_usb_fb_back(fb), f->data,
+			       f->size);
+			ctlra_dev_impl_usb_fb_flush(fb);
+			frames++;
+			break;
+		}
+	}
+
+	CTLRA_INFO(ctlra, "%s resumed after %llu ms: %u lights, %u frames\n",
+		   dev->info.device, (unsigned long long)(away / 1000000),
+		   lights, frames);
+}
+
+static void ctlra_usb_impl_identity_free(struct ctlra_t *ctlra)
+{
+	struct usb_identity_map_t *map = ctlra->identity;
+	if(!map)
+		return;
+	for(uint32_t i = 0; i < map->count; i++)
+		ctlra_usb_impl_resume_free(map->entries[i].resume);
+	free(map->entries);
+	free(map->by_loc);
+	free(map->by_serial);
+	free(map);
+	ctlra->identity = 0;
+}
+
+/* Records where on the bus a device is, which stays readable from the
+ * libusb_device after it has been unplugged */
+static void ctlra_usb_impl_location(libusb_device *dev, uint8_t *bus,
+				    uint8_t *port_count, uint8_t *ports)
+{
+	*bus = libusb_get_bus_number(dev);
+	int n = libusb_get_port_numbers(dev, ports, CTLRA_USB_PORTS_MAX);
+	*port_count = n > 0 ? n : 0;
+}
+
+/* Hotplug events are not acted on inside the libusb callback, as that
+ * would run driver connect() and the application's accept callback in
+ * the middle of event handling, stalling input from all other devices.
+ * Instead the callback pushes onto a single-producer single-consumer
+ * ring, which ctlra_idle_iter() drains at a bounded rate. */
+#define CTLRA_HOTPLUG_QUEUE_SIZE 32
+#define CTLRA_HOTPLUG_EVENTS_PER_ITER 8
+#define CTLRA_HOTPLUG_ARRIVALS_PER_ITER 1
+
+struct usb_hotplug_t {
+	uint8_t arrived;
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t serial_idx;
+	uint8_t bus;
+	uint8_t port_count;
+	uint8_t ports[CTLRA_USB_PORTS_MAX];
+	/* referenced by the callback, unreferenced once processed */
+	libusb_device *dev;
+	/* opened by the callback on arrival, handed to the driver */
+	libusb_device_handle *handle;
+};
+
+struct usb_hotplug_queue_t {
+	/* written only by the producer (hotplug callback) */
+	uint32_t head;
+	/* written only by the consumer (idle iter) */
+	uint32_t tail;
+	struct usb_hotplug_t ev[CTLRA_HOTPLUG_QUEUE_SIZE];
+};
+
+static void ctlra_usb_impl_hotplug_release(struct usb_hotplug_t *hp)
+{
+	if(hp->handle)
+		libusb_close(hp->handle);
+	if(hp->dev)
+		libusb_unref_device(hp->dev);
+	hp->handle = 0;
+	hp->dev = 0;
+}
+
 static int ctlra_usb_impl_hotplug_cb(libusb_context *ctx,
                                      libusb_device *dev,
                                      libusb_hotplug_event event,
@@ -122,117 +848,206 @@ static int ctlra_usb_impl_hotplug_cb(libusb_context *ctx,
 {
 	int ret;
 	struct ctlra_t *ctlra = user_data;
+	struct usb_hotplug_queue_t *q = ctlra->usb_hotplug;
 	struct libusb_device_descriptor desc;
 	ret = libusb_get_device_descriptor(dev, &desc);
 	if(ret != LIBUSB_SUCCESS) {
 		CTLRA_ERROR(ctlra, "libusb err device desc: %d\n", ret);
-		return -1;
+		return 0;
 	}
-	if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
-		/* Quirks:
-		 * If a device is unplugged, usually the libusb read/write
-		 * will fail, causing the device to be banished, and then
-		 * cleaned up and removed automatically by Ctlra. The
-		 * exception is devices that read /dev/hidrawX manually,
-		 * because they return -1 if no data is available or there
-		 * is an error reading the file descriptor.
-		 *
-		 * The solution used here it to use libusb to detect the
-		 * removal of the device, and then banish the ctlra_dev_t
-		 * instance if it matches the device */
-		CTLRA_INFO(ctlra, "Device removed: %04x:%04x\n",
+
+	uint32_t head = q->head;
+	uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if(head - tail >= CTLRA_HOTPLUG_QUEUE_SIZE) {
+		CTLRA_WARN(ctlra, "hotplug queue full, dropping %04x:%04x\n",
 			   desc.idVendor, desc.idProduct);
+		return 0;
+	}
 
-		/* NI Maschine Mikro MK2 */
-		if(desc.idVendor == 0x17cc && desc.idProduct == 0x1200) {
-			struct ctlra_dev_t *ni_mm;
-			int err = ctlra_impl_dev_get_by_vid_pid(ctlra,
-								0x17cc,
-								0x1200,
-								&ni_mm);
-			ctlra_dev_disconnect(ni_mm);
+	struct usb_hotplug_t *hp = &q->ev[head & (CTLRA_HOTPLUG_QUEUE_SIZE-1)];
+	hp->arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+	hp->vid = desc.idVendor;
+	hp->pid = desc.idProduct;
+	hp->serial_idx = desc.iSerialNumber;
+	hp->handle = 0;
+	hp->dev = libusb_ref_device(dev);
+	ctlra_usb_impl_location(dev, &hp->bus, &hp->port_count, hp->ports);
+
+	/* The device is opened once here, and that handle is passed to
+	 * the driver's first ctlra_dev_impl_usb_open_interface() call */
+	if(hp->arrived) {
+		ret = libusb_open(dev, &hp->handle);
+		if(ret != LIBUSB_SUCCESS) {
+			CTLRA_WARN(ctlra, "failed to open hotplugged %04x:%04x\n",
+				   desc.idVendor, desc.idProduct);
+			libusb_unref_device(hp->dev);
+			hp->dev = 0;
+			return 0;
 		}
+	}
+
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
 
-		/* Search through all devices matching on VID and PID.
-		 * If the device matches, we disconnect it from Ctlra.
-		 * TODO: Improve this to use the serial number if present.
-		 */
-		struct ctlra_dev_t *dev_iter = ctlra->dev_list;
-		while(dev_iter) {
-			struct ctlra_dev_t *tmp = dev_iter;
-			dev_iter = dev_iter->dev_list_next;
-
-			if(tmp->info.vendor_id == desc.idVendor &&
-				tmp->info.device_id == desc.idProduct) {
-				/* as the device has just been unplugged,
-				 * its too late to update state, so banish
-				 * and then disconnect */
-				tmp->banished = 1;
-				ctlra_dev_disconnect(tmp);
+static void ctlra_usb_impl_hotplug_left(struct ctlra_t *ctlra,
+					struct usb_hotplug_t *hp)
+{
+	/* Quirks:
+	 * If a device is unplugged, usually the libusb read/write
+	 * will fail, causing the device to be banished, and then
+	 * cleaned up and removed automatically by Ctlra. The
+	 * exception is devices that read /dev/hidrawX manually,
+	 * because they return -1 if no data is available or there
+	 * is an error reading the file descriptor.
+	 *
+	 * The solution used here it to use libusb to detect the
+	 * removal of the device, and then banish the ctlra_dev_t
+	 * instance if it matches the device */
+	CTLRA_INFO(ctlra, "Device removed: %04x:%04x\n", hp->vid, hp->pid);
+
+	/* Find exactly the instance at the location that was unplugged,
+	 * so that identical controllers stay connected */
+	struct ctlra_dev_t *dev = 0;
+	struct usb_identity_t *e = 0;
+	if(ctlra->identity)
+		e = usb_identity_find_loc(ctlra->identity, hp->bus,
+					  hp->port_count, hp->ports, 1);
+	if(e && e->vid == hp->vid && e->pid == hp->pid)
+		dev = e->dev;
+
+	/* No location, or none on record: match the VID:PID instead. The
+	 * serial of a departed device can't be read, so the libusb device
+	 * stands in for it. Where either side has no location, a lone
+	 * instance of that VID:PID is taken as the one that left, else
+	 * identical controllers are left alone and the next transfer to
+	 * the departed one banishes it */
+	if(!dev) {
+		struct ctlra_dev_t *only = 0;
+		uint32_t candidates = 0;
+		for(struct ctlra_dev_t *iter = ctlra->dev_list; iter;
+		    iter = iter->dev_list_next) {
+			if(iter->banished ||
+			   iter->info.vendor_id != hp->vid ||
+			   iter->info.device_id != hp->pid)
+				continue;
+			if(iter->usb_device == hp->dev) {
+				dev = iter;
+				break;
 			}
+			if(hp->port_count && iter->usb_port_count) {
+				if(iter->usb_bus == hp->bus &&
+				   iter->usb_port_count == hp->port_count &&
+				   memcmp(iter->usb_ports, hp->ports,
+					  hp->port_count) == 0) {
+					dev = iter;
+					break;
+				}
+				continue;
+			}
+			only = iter;
+			candidates++;
 		}
-
-		return 0;
+		if(!dev && candidates == 1)
+			dev = only;
 	}
+	if(!dev)
+		return;
 
-	if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+	/* as the device has just been unplugged, its too late to update
+	 * state, so banish and then disconnect */
+	dev->banished = 1;
+	ctlra_dev_disconnect(dev);
+}
 
-		libusb_device_handle *handle = 0;
-		ret = libusb_open(dev, &handle);
-		if(ret != LIBUSB_SUCCESS)
-			return -1;
+static void ctlra_usb_impl_hotplug_arrived(struct ctlra_t *ctlra,
+					   struct usb_hotplug_t *hp)
+{
+	if(debug_print_check(ctlra, CTLRA_DEBUG_INFO)) {
 		uint8_t buf[255];
-		ret = ctlra_usb_impl_get_serial(handle, desc.iSerialNumber,
-					  buf, 255);
+		int ret = ctlra_usb_impl_get_serial(hp->handle, hp->serial_idx,
+						    buf, 255);
 		if(ret)
 			snprintf((char *)buf, sizeof(buf), "---");
-
 		CTLRA_INFO(ctlra, "Device attached: %04x:%04x, serial %s\n",
-			   desc.idVendor, desc.idProduct, buf);
-		/* Quirks:
-		 * Here we can handle strange hotplug issues. For example,
-		 * controllers that have a USB hub integrated show as the
-		 * hub first (so the hotplug picks up that VID/PID pair,
-		 * not the device itself for some reason). Here we can
-		 * modify the VID/PID pair based on known corner cases:
-		 */
-		uint32_t quirk_vid = desc.idVendor;
-		uint32_t quirk_pid = desc.idProduct;
-		switch(quirk_vid) {
-		case 0x17cc:
-			/* NI Kontrol D2, change PID from 0x1403 (hub) back
-			 * to the normal PID of 0x1400 */
-			if(quirk_pid == 0x1403)
-				quirk_pid = 0x1400;
-			break;
-		default: break;
-		};
-
-		int id = ctlra_impl_get_id_by_vid_pid(quirk_vid, quirk_pid);
-		if(id < 0) {
-			/* Device is not supported by Ctlra, so release
-			 * the libusb handle which was opened to retrieve
-			 * the serial from the device */
-			CTLRA_WARN(ctlra, "Ctlra does not support hotplugged device %x %x\n",
-				   quirk_vid, quirk_pid);
-			libusb_close(handle);
-			return -1;
-		}
+			   hp->vid, hp->pid, buf);
+	}
 
-		int accepted = ctlra_impl_accept_dev(ctlra, id);
-		if(!accepted)
-			libusb_close(handle);
+	/* Quirks:
+	 * Here we can handle strange hotplug issues. For example,
+	 * controllers that have a USB hub integrated show as the
+	 * hub first (so the hotplug picks up that VID/PID pair,
+	 * not the device itself for some reason). Here we can
+	 * modify the VID/PID pair based on known corner cases:
+	 */
+	uint32_t quirk_vid = hp->vid;
+	uint32_t quirk_pid = hp->pid;
+	switch(quirk_vid) {
+	case 0x17cc:
+		/* NI Kontrol D2, change PID from 0x1403 (hub) back
+		 * to the normal PID of 0x1400 */
+		if(quirk_pid == 0x1403)
+			quirk_pid = 0x1400;
+		break;
+	default: break;
+	};
+
+	int id = ctlra_impl_get_id_by_vid_pid(quirk_vid, quirk_pid);
+	if(id < 0) {
+		CTLRA_WARN(ctlra, "Ctlra does not support hotplugged device %x %x\n",
+			   quirk_vid, quirk_pid);
+		return;
+	}
 
-		/* close the handle, since its no longer needed with
-		 * the device set up. This is different in the hotplug
-		 * path than the present-on-probe path, but also works.
-		 */
-		libusb_close(handle);
+	/* Hand the hotplugged device and its open handle to the driver,
+	 * unless a quirk remapped the PID: then the device the driver
+	 * wants is not this one, and it must enumerate */
+	int remapped = quirk_vid != hp->vid || quirk_pid != hp->pid;
+	struct ctlra_usb_probe_t probe = {
+		.ctlra = ctlra,
+		.usb_device = remapped ? 0 : hp->dev,
+		.usb_handle = remapped ? 0 : hp->handle,
+	};
+	int accepted = ctlra_impl_accept_dev(ctlra, id, &probe);
+	(void)accepted;
+
+	/* the driver took ownership of the handle if it used it */
+	if(!remapped)
+		hp->handle = probe.usb_handle;
+}
 
+uint32_t ctlra_impl_usb_hotplug_process(struct ctlra_t *ctlra)
+{
+	struct usb_hotplug_queue_t *q = ctlra->usb_hotplug;
+	if(!q)
 		return 0;
+
+	uint32_t tail = q->tail;
+	uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	uint32_t events = 0;
+	uint32_t arrivals = 0;
+
+	while(tail != head && events < CTLRA_HOTPLUG_EVENTS_PER_ITER &&
+	      arrivals < CTLRA_HOTPLUG_ARRIVALS_PER_ITER) {
+		struct usb_hotplug_t *hp =
+			&q->ev[tail & (CTLRA_HOTPLUG_QUEUE_SIZE-1)];
+		if(hp->arrived) {
+			/* wait for the application to ctlra_probe() */
+			if(!ctlra->accept_dev_func)
+				break;
+			ctlra_usb_impl_hotplug_arrived(ctlra, hp);
+			arrivals++;
+		} else {
+			ctlra_usb_impl_hotplug_left(ctlra, hp);
+		}
+		ctlra_usb_impl_hotplug_release(hp);
+		events++;
+		tail++;
+		__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
 	}
 
-	return 0;
+	/* events left for the next iteration */
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - tail;
 }
 
 void ctlra_impl_usb_idle_iter(struct ctlra_t *ctlra)
@@ -244,6 +1059,33 @@ void ctlra_impl_usb_idle_iter(struct ctlra_t *ctlra)
 	libusb_handle_events_timeout_completed(ctlra->ctx, &tv, NULL);
 }
 
+int ctlra_impl_usb_get_pollfds(struct ctlra_t *ctlra, struct pollfd *fds,
+				uint32_t max)
+{
+	/* NULL where the platform has no pollable fds, the timeout then
+	 * bounds the latency instead */
+	const struct libusb_pollfd **usb_fds = libusb_get_pollfds(ctlra->ctx);
+	int n = 0;
+	for(; usb_fds && usb_fds[n]; n++) {
+		if(n >= max)
+			continue;
+		fds[n].fd = usb_fds[n]->fd;
+		fds[n].events = usb_fds[n]->events;
+		fds[n].revents = 0;
+	}
+	libusb_free_pollfds(usb_fds);
+	return n;
+}
+
+int ctlra_impl_usb_get_timeout(struct ctlra_t *ctlra)
+{
+	/* wake in time for libusb to expire transfer timeouts */
+	struct timeval tv;
+	if(libusb_get_next_timeout(ctlra->ctx, &tv) != 1)
+		return -1;
+	return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
 int ctlra_dev_impl_usb_init(struct ctlra_t *ctlra)
 {
 	int ret;
@@ -264,6 +1106,12 @@ int ctlra_dev_impl_usb_init(struct ctlra_t *ctlra)
 	}
 	ctlra->usb_initialized = 1;
 
+	ctlra->usb_hotplug = calloc(1, sizeof(struct usb_hotplug_queue_t));
+	if(!ctlra->usb_hotplug) {
+		CTLRA_ERROR(ctlra, "failed to allocate hotplug queue %d\n", 0);
+		return -ENOMEM;
+	}
+
 	if(!libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG)) {
 		CTLRA_WARN(ctlra, "Ctlra: Hotplug support on platform: %d\n", 0);
 		return -2;
@@ -288,8 +1136,139 @@ int ctlra_dev_impl_usb_init(struct ctlra_t *ctlra)
 	return 0;
 }
 
+/* A device found on the bus at probe time, and its connected instance */
+struct usb_probe_slot_t {
+	int id;
+	struct ctlra_usb_probe_t probe;
+	struct ctlra_dev_t *dev;
+};
+
+struct usb_probe_work_t {
+	struct usb_probe_slot_t *slots;
+	uint32_t count;
+	uint32_t next;
+};
+
+#define CTLRA_USB_OPEN_THREADS_DEFAULT 4
+#define CTLRA_USB_OPEN_THREADS_MAX 16
+
+static void *ctlra_usb_impl_probe_worker(void *data)
+{
+	struct usb_probe_work_t *work = data;
+	for(;;) {
+		uint32_t i = __atomic_fetch_add(&work->next, 1,
+						__ATOMIC_RELAXED);
+		if(i >= work->count)
+			break;
+		struct usb_probe_slot_t *slot = &work->slots[i];
+		slot->dev = __ctlra_devices[slot->id].connect(0x0, 0,
+							      &slot->probe);
+	}
+	return 0;
+}
+
+/* Runs the connect() of each slot, which opens the device, claims its
+ * interfaces and reads the serial. These are blocking USB round trips,
+ * so with flags_usb_parallel_open they are spread over worker threads.
+ * Connect() only touches its own device, so needs no locking. */
+static void ctlra_usb_impl_probe_connect(struct ctlra_t *ctlra,
+					 struct usb_probe_slot_t *slots,
+					 uint32_t count)
+{
+	struct usb_probe_work_t work = {
+		.slots = slots,
+		.count = count,
+		.next = 0,
+	};
+
+	uint32_t n_threads = 0;
+	if(ctlra->opts.flags_usb_parallel_open && count > 1) {
+		n_threads = ctlra->opts.usb_open_threads;
+		if(n_threads == 0)
+			n_threads = CTLRA_USB_OPEN_THREADS_DEFAULT;
+		if(n_threads > CTLRA_USB_OPEN_THREADS_MAX)
+			n_threads = CTLRA_USB_OPEN_THREADS_MAX;
+		if(n_threads > count)
+			n_threads = count;
+	}
+
+	pthread_t threads[CTLRA_USB_OPEN_THREADS_MAX];
+	uint32_t started = 0;
+	for(; started < n_threads; started++) {
+		int ret = pthread_create(&threads[started], 0,
+					 ctlra_usb_impl_probe_worker, &work);
+		if(ret) {
+			CTLRA_WARN(ctlra, "probe thread create failed %d\n",
+				   ret);
+			break;
+		}
+	}
+
+	/* The caller works too: this also covers the serial case, and
+	 * any thread that failed to start */
+	ctlra_usb_impl_probe_worker(&work);
+
+	for(uint32_t i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+}
+
+int ctlra_impl_usb_probe(struct ctlra_t *ctlra)
+{
+	if(!ctlra->usb_initialized)
+		return 0;
+
+	libusb_device **devs;
+	ssize_t cnt = libusb_get_device_list(ctlra->ctx, &devs);
+	if(cnt < 0) {
+		CTLRA_ERROR(ctlra, "failed to list usb devices: %s\n",
+			    libusb_error_name(cnt));
+		return 0;
+	}
+
+	struct usb_probe_slot_t *slots = calloc(cnt ? cnt : 1,
+						sizeof(*slots));
+	if(!slots) {
+		libusb_free_device_list(devs, 1);
+		return 0;
+	}
+
+	/* One pass over the bus: each device is matched against the
+	 * registered drivers by hash, and handed to the driver so that it
+	 * does not have to enumerate the bus again to find itself */
+	uint32_t count = 0;
+	for(ssize_t i = 0; i < cnt; i++) {
+		struct libusb_device_descriptor desc;
+		if(libusb_get_device_descriptor(devs[i], &desc) < 0)
+			continue;
+
+		int id = ctlra_impl_get_id_by_vid_pid(desc.idVendor,
+						      desc.idProduct);
+		if(id < 0)
+			continue;
+
+		slots[count].id = id;
+		slots[count].probe.ctlra = ctlra;
+		slots[count].probe.usb_device = devs[i];
+		count++;
+	}
+
+	ctlra_usb_impl_probe_connect(ctlra, slots, count);
+
+	/* Devices are linked and offered to the application on this
+	 * thread, in bus order, regardless of which opened first */
+	int num_accepted = 0;
+	for(uint32_t i = 0; i < count; i++)
+		num_accepted += ctlra_impl_accept_connected(ctlra,
+							    slots[i].dev);
+
+	free(slots);
+	libusb_free_device_list(devs, 1);
+
+	return num_accepted;
+}
+
 int ctlra_dev_impl_usb_open(struct ctlra_dev_t *ctlra_dev, int vid,
-                            int pid)
+                            int pid, void *future)
 {
 	int ret;
 
@@ -298,12 +1277,43 @@ int ctlra_dev_impl_usb_open(struct ctlra_dev_t *ctlra_dev, int vid,
 	int i = 0, j = 0;
 	uint8_t path[USB_PATH_MAX];
 
+	struct ctlra_t *ctlra = ctlra_dev->ctlra_context;
+
+	/* The device is linked to the instance only after connect()
+	 * returns, but a driver that fails later in connect() closes it
+	 * through ctlra_dev_impl_usb_close(), which needs the instance */
+	struct ctlra_usb_probe_t *probe = future;
+	if(probe && probe->ctlra) {
+		ctlra = probe->ctlra;
+		ctlra_dev->ctlra_context = ctlra;
+	}
+
+	/* The core already found the device: no need to enumerate */
+	if(probe && probe->usb_device) {
+		struct libusb_device_descriptor desc;
+		dev = probe->usb_device;
+		if(libusb_get_device_descriptor(dev, &desc) < 0 ||
+		   desc.idVendor != vid || desc.idProduct != pid) {
+			CTLRA_ERROR(ctlra, "probed device is not %04x:%04x\n",
+				    vid, pid);
+			goto fail;
+		}
+		ctlra_dev->info.serial_number = desc.iSerialNumber;
+		ctlra_dev->info.vendor_id     = desc.idVendor;
+		ctlra_dev->info.device_id     = desc.idProduct;
+		ctlra_usb_impl_location(dev, &ctlra_dev->usb_bus,
+					&ctlra_dev->usb_port_count,
+					ctlra_dev->usb_ports);
+		/* take ownership of an already opened handle */
+		ctlra_dev->usb_handle_probed = probe->usb_handle;
+		probe->usb_handle = 0;
+		goto found;
+	}
+
 	int cnt = libusb_get_device_list(NULL, &devs);
 	if (cnt < 0)
 		goto fail;
 
-	struct ctlra_t *ctlra = ctlra_dev->ctlra_context;
-
 	while ((dev = devs[i++]) != NULL) {
 		struct libusb_device_descriptor desc;
 		int r = libusb_get_device_descriptor(dev, &desc);
@@ -331,6 +1341,9 @@ int ctlra_dev_impl_usb_open(struct ctlra_dev_t *ctlra_dev, int vid,
 			ctlra_dev->info.serial_number = desc.iSerialNumber;
 			ctlra_dev->info.vendor_id     = desc.idVendor;
 			ctlra_dev->info.device_id     = desc.idProduct;
+			ctlra_usb_impl_location(dev, &ctlra_dev->usb_bus,
+						&ctlra_dev->usb_port_count,
+						ctlra_dev->usb_ports);
 			break;
 		}
 	}
@@ -339,13 +1352,25 @@ int ctlra_dev_impl_usb_open(struct ctlra_dev_t *ctlra_dev, int vid,
 
 	if(!dev)
 		goto fail;
+found:
 	ctlra_dev->usb_device = dev;
 
+	if(ctlra_usb_impl_pool_init(ctlra_dev)) {
+		CTLRA_ERROR(ctlra, "failed to allocate usb xfer pool for %04x:%04x\n",
+			    vid, pid);
+		goto fail;
+	}
+
 	memset(ctlra_dev->usb_handle, 0,
 	       sizeof(ctlra_dev->usb_handle));
 
 	return 0;
 fail:
+	/* nothing else is held: the driver only frees itself on failure */
+	if(ctlra_dev->usb_handle_probed) {
+		libusb_close(ctlra_dev->usb_handle_probed);
+		ctlra_dev->usb_handle_probed = 0;
+	}
 	return -1;
 }
 
@@ -364,8 +1389,15 @@ int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
 	libusb_device *usb_dev = ctlra_dev->usb_device;
 	libusb_device_handle *handle = 0;
 
-	/* now that we've found the device, open the handle */
-	int ret = libusb_open(usb_dev, &handle);
+	/* now that we've found the device, open the handle, unless the
+	 * hotplug path already opened one */
+	int ret = LIBUSB_SUCCESS;
+	if(ctlra_dev->usb_handle_probed) {
+		handle = ctlra_dev->usb_handle_probed;
+		ctlra_dev->usb_handle_probed = 0;
+	} else {
+		ret = libusb_open(usb_dev, &handle);
+	}
 	if(ret != LIBUSB_SUCCESS) {
 		CTLRA_ERROR(ctlra, "Error in opening interface, dev %s\n",
 		       ctlra_dev->info.device);
@@ -411,21 +1443,26 @@ int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
 }
 
 #if CTLRA_USE_ASYNC_XFER
+static void ctlra_usb_impl_pending_submit(struct ctlra_dev_t *dev,
+					  uint32_t lane_idx);
+
 static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
 				       const int read)
 {
-	struct ctlra_dev_t *dev = xfr->user_data;
+	struct usb_async_t *async = xfr->user_data;
+	struct ctlra_dev_t *dev = async->dev;
 	struct ctlra_t *ctlra = dev->ctlra_context;
 
-	const int stat_idx =
-		read ?  USB_XFER_INFLIGHT_READ : USB_XFER_INFLIGHT_WRITE;
+	const int stat_idx = read ? USB_XFER_INFLIGHT_READ :
+				    usb_lanes[async->bulk].stat_inflight;
 
 	switch(xfr->status) {
 	/* Success */
 	case LIBUSB_TRANSFER_COMPLETED: {
+		/* one timestamp for every event decoded from the report */
+		dev->event_timestamp = ctlra_impl_time_ns();
 		CTLRA_DRIVER(ctlra, "Ctlra: USB transfer completed: size %d\n",
 			     xfr->actual_length);
-		dev = xfr->user_data;
 		if(!dev->usb_read_cb) {
 			CTLRA_ERROR(ctlra, "DRIVER ERROR: USB READ CB = %d\n", 0);
 			break;
@@ -439,6 +1476,8 @@ static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
 		}
 		dev->usb_read_cb(dev, xfr->endpoint, xfr->buffer,
 				 xfr->actual_length);
+		/* all events of the report go to the app in one call */
+		ctlra_dev_impl_event_report_done(dev);
 		} break;
 	case LIBUSB_TRANSFER_CANCELLED:
 		dev->usb_xfer_counts[USB_XFER_CANCELLED]++;
@@ -455,7 +1494,6 @@ static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
 	case LIBUSB_TRANSFER_OVERFLOW:
 		CTLRA_DRIVER(ctlra, "Ctlra: USB transfer error %s, dev banished.\n",
 			     libusb_error_name(xfr->status));
-		dev = xfr->user_data;
 		dev->banished = 1;
 		break;
 	default:
@@ -464,33 +1502,36 @@ static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
 		break;
 	}
 
+	/* Persistent reads go straight back to libusb, so a transfer is
+	 * always waiting on the endpoint, independent of the app's loop */
+	if(async->persistent && !dev->banished &&
+	   xfr->status == LIBUSB_TRANSFER_COMPLETED) {
+		int ret = libusb_submit_transfer(xfr);
+		if(ret == 0) {
+			dev->usb_xfer_counts[USB_XFER_INT_READ]++;
+			return;
+		}
+		CTLRA_DRIVER(ctlra, "persistent read resubmit failed: %s\n",
+			     libusb_error_name(ret));
+	}
+	/* not resubmitted, the idle iteration arms a new one */
+	if(async->persistent)
+		dev->usb_read_armed--;
+
 	dev->usb_xfer_counts[stat_idx]--;
 
-	/* get async from xfr->buffer address, see usb_async_t struct */
-	struct usb_async_t *async = (struct usb_async_t *)
-		(((uint8_t *)xfr->buffer) - offsetof(struct usb_async_t, malloc_mem));
-	CTLRA_DRIVER(ctlra, "free %s async @ %p\n",
-		     read == 1 ? "read" : "write", async);
+	if(!read)
+		ctlra_usb_impl_latency(dev, async->bulk, async->t_queued);
 
-	XFER_VALIDATE(dev);
+	CTLRA_DRIVER(ctlra, "release %s async @ %p\n",
+		     read == 1 ? "read" : "write", async);
+	ctlra_usb_impl_pool_put(async);
 
-	/* remove node from double linked list*/
-	struct usb_async_t *next = async->next;
-	struct usb_async_t *prev = async->prev;
-	CTLRA_DRIVER(ctlra, "async = %p, next %p, prev %p\n", async, next, prev);
-	if(next)
-		next->prev = prev;
-	if(prev) {
-		prev->next = next;
-	} else {
-		dev->usb_async_next = next;
+	/* a write slot is now free: send queued writes, LEDs first */
+	if(!read) {
+		ctlra_usb_impl_pending_submit(dev, USB_LANE_INT);
+		ctlra_usb_impl_pending_submit(dev, USB_LANE_BULK);
 	}
-
-	XFER_VALIDATE(dev);
-
-	free(async);
-
-	libusb_free_transfer(xfr);
 }
 
 static void ctlra_usb_xfr_done_cb(struct libusb_transfer *xfr)
@@ -530,48 +1571,25 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 	/* timeout of zero means no timeout. For ASync case, this means
 	 * the buffer will wait until data becomes available - good! */
 	const uint32_t timeout = 0;
-	struct libusb_transfer *xfr;
-	xfr = libusb_alloc_transfer(0);
-	if(xfr == 0) {
-		CTLRA_DRIVER(ctlra, "xfr == %p\n", xfr);
-	}
-
-	/* Malloc space for the USB transaction - not ideal, but we have
-	 * to pass ownership of the data to the USB library, and we can't
-	 * pass the actual dev_t owned data, since the application may
-	 * update it again before the USB transaction completes.
-	 *
-	 * Ctlra has to track the async references to cancel them for a
-	 * clean shutdown. Hence, we allocate a usb_async_t struct, which
-	 * is used as a linked list for xfers, at little extra overhead
-	 * due to just allocating a slightly block, and keeping the list
-	 * pointer at the start of the block, before the libusb xfer mem */
-	struct usb_async_t *async = malloc(size + sizeof(struct usb_async_t));
-
-	XFER_VALIDATE(dev);
-
-	/* insert at head into double-linked list for device */
-	struct usb_async_t *dev_current = dev->usb_async_next;
-	if(dev_current)
-		dev_current->prev = async;
-	async->next = dev_current;
-	async->prev = 0;
-	dev->usb_async_next = async;
 
-	XFER_VALIDATE(dev);
-
-	/* back-pointer from async to xfer */
-	async->xfer = xfr;
-
-	void *usb_data = &async->malloc_mem;
+	/* The libusb transfer and its buffer are owned by the device pool:
+	 * the data is passed to libusb, and the buffer can not be reused
+	 * until the completion callback returns it to the pool. The pool
+	 * also tracks in-flight xfers, so they can be cancelled at close */
+	struct usb_async_t *async = ctlra_usb_impl_pool_get(dev, 0, size);
+	if(!async) {
+		dev->usb_xfer_counts[USB_XFER_ERROR]++;
+		return 0;
+	}
+	struct libusb_transfer *xfr = async->xfer;
 
 	libusb_fill_interrupt_transfer(xfr,
 				  dev->usb_handle[idx],
 	                          endpoint,
-	                          usb_data,
+	                          async->buf,
 	                          size,
 	                          ctlra_usb_xfr_done_cb,
-	                          dev,
+	                          async,
 	                          timeout);
 
 	int res = libusb_submit_transfer(xfr);
@@ -580,11 +1598,10 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 	 * time. The _IO error would show after (almost exactly) 1 minute
 	 * of read requests. All button presses are still captured, and
 	 * writes to LEDs are serviced correctly. There is no negative
-	 * impact of these IO errors - so just free buffers and next iter
-	 * of reads will catch any data if available */
+	 * impact of these IO errors - so just return the async to the pool
+	 * and next iter of reads will catch any data if available */
 	if(res) {
-		libusb_free_transfer(xfr);
-		free(usb_data);
+		ctlra_usb_impl_pool_put(async);
 		if(res == LIBUSB_ERROR_IO)
 			return 0;
 
@@ -630,77 +1647,241 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 			    dev->usb_read_cb);
 		return 0;
 	}
+	dev->event_timestamp = ctlra_impl_time_ns();
 	dev->usb_read_cb(dev, endpoint, data, transferred);
+	ctlra_dev_impl_event_report_done(dev);
 	dev->usb_xfer_counts[USB_XFER_INT_READ]++;
 	return r;
 #endif /* CTLRA_USE_ASYNC_XFER */
 
 }
 
-int ctlra_dev_impl_usb_interrupt_write(struct ctlra_dev_t *dev, uint32_t idx,
-                                       uint32_t endpoint, uint8_t *data,
-                                       uint32_t size)
+/* Submits persistent reads until all registered ones are in flight */
+static int ctlra_usb_impl_read_arm(struct ctlra_dev_t *dev)
 {
-	int transferred;
-	struct ctlra_t *ctlra = dev->ctlra_context;
 	const uint32_t timeout = 0;
 
-	int inf = dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE];
-	if(inf >= CTLRA_ASYNC_READ_MAX) {
-		dev->usb_xfer_counts[USB_XFER_ERROR]++;
-		return 0;
+	while(dev->usb_read_armed < dev->usb_read_count) {
+		struct usb_async_t *async =
+			ctlra_usb_impl_pool_get(dev, 0, dev->usb_read_size);
+		if(!async) {
+			dev->usb_xfer_counts[USB_XFER_ERROR]++;
+			return -ENOSPC;
+		}
+		async->persistent = 1;
+
+		libusb_fill_interrupt_transfer(async->xfer,
+					       dev->usb_handle[dev->usb_read_idx],
+					       dev->usb_read_endpoint,
+					       async->buf,
+					       dev->usb_read_size,
+					       ctlra_usb_xfr_done_cb,
+					       async,
+					       timeout);
+		int res = libusb_submit_transfer(async->xfer);
+		if(res) {
+			ctlra_usb_impl_pool_put(async);
+			return res == LIBUSB_ERROR_NO_DEVICE ? -ENODEV : -EIO;
+		}
+
+		dev->usb_read_armed++;
+		dev->usb_xfer_counts[USB_XFER_INFLIGHT_READ]++;
+		dev->usb_xfer_counts[USB_XFER_INT_READ]++;
+	}
+
+	return 0;
+}
+
+int ctlra_dev_impl_usb_interrupt_read_register(struct ctlra_dev_t *dev,
+					       uint32_t idx, uint32_t endpoint,
+					       uint32_t size, uint32_t count)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+	int inf_reads = dev->usb_xfer_counts[USB_XFER_INFLIGHT_READ];
+	if(count == 0 || dev->usb_read_count ||
+	   inf_reads + count > CTLRA_ASYNC_READ_MAX) {
+		CTLRA_ERROR(ctlra, "[%s] invalid persistent read count %d\n",
+			    dev->info.device, count);
+		return -EINVAL;
+	}
+
+	dev->usb_read_idx = idx;
+	dev->usb_read_endpoint = endpoint;
+	dev->usb_read_size = size;
+	dev->usb_read_count = count;
+
+	int ret = ctlra_usb_impl_read_arm(dev);
+	if(ret)
+		CTLRA_ERROR(ctlra, "[%s] error submitting persistent reads: %d\n",
+			    dev->info.device, ret);
+	return ret;
+}
+
+void ctlra_impl_usb_read_rearm(struct ctlra_dev_t *dev)
+{
+	if(dev->banished || dev->usb_read_armed >= dev->usb_read_count)
+		return;
+
+	struct ctlra_t *ctlra = dev->ctlra_context;
+	uint32_t missing = dev->usb_read_count - dev->usb_read_armed;
+	int ret = ctlra_usb_impl_read_arm(dev);
+	CTLRA_DRIVER(ctlra, "[%s] re-armed %d persistent reads, ret %d\n",
+		     dev->info.device,
+		     missing - (dev->usb_read_count - dev->usb_read_armed),
+		     ret);
+
+	/* without reads in flight the device would silently stop sending
+	 * input, banish it so that it is reconnected instead */
+	if(ret && (dev->usb_read_armed == 0 || ret == -ENODEV)) {
+		CTLRA_ERROR(ctlra, "[%s] no input reads in flight, banished\n",
+			    dev->info.device);
+		ctlra_dev_impl_banish(dev);
 	}
+}
 
 #if CTLRA_USE_ASYNC_XFER
-	struct libusb_transfer *xfr;
-	xfr = libusb_alloc_transfer(0);
-	if(xfr == 0)
-		CTLRA_ERROR(ctlra, "write xfr == %p!\n", xfr);
+/* Submits a write on a lane. If *from* is a pending entry, its payload is
+ * swapped with the async buffer instead of being copied */
+static int
+ctlra_usb_impl_write_submit(struct ctlra_dev_t *dev, uint32_t lane_idx,
+			    uint32_t idx, uint32_t endpoint, uint8_t *data,
+			    uint32_t size, uint64_t t_queued,
+			    struct usb_pending_t *from)
+{
+	const struct usb_lane_info_t *info = &usb_lanes[lane_idx];
+	const uint8_t bulk = lane_idx == USB_LANE_BULK;
+	const uint32_t timeout = 0;
 
-	/* see comment in interrupt read for malloc() and async details */
-	struct usb_async_t *async = malloc(size + sizeof(struct usb_async_t));
+	/* see comment in interrupt read for pool and async details */
+	struct usb_async_t *async = ctlra_usb_impl_pool_get(dev, bulk,
+							    from ? 0 : size);
 	if(!async) {
-		dev->usb_xfer_counts[USB_XFER_ERROR]++;
+		dev->usb_xfer_counts[info->stat_error]++;
 		return -ENOSPC;
 	}
-	XFER_VALIDATE(dev);
-	struct usb_async_t *dev_current = dev->usb_async_next;
-	if(dev_current)
-		dev_current->prev = async;
-	async->next = dev_current;
-	async->prev = 0;
-	dev->usb_async_next = async;
-	XFER_VALIDATE(dev);
 
-	/* back-pointer from async to xfer */
-	async->xfer = xfr;
-
-	void *usb_data = &async->malloc_mem;
-	memcpy(usb_data, data, size);
+	if(from) {
+		uint8_t *buf = async->buf;
+		uint32_t buf_size = async->buf_size;
+		async->buf = from->data;
+		async->buf_size = from->data_size;
+		from->data = buf;
+		from->data_size = buf_size;
+	} else {
+		memcpy(async->buf, data, size);
+	}
+	async->t_queued = t_queued;
+
+	struct libusb_transfer *xfr = async->xfer;
+	if(bulk)
+		libusb_fill_bulk_transfer(xfr, dev->usb_handle[idx],
+					  endpoint,
+					  async->buf,
+					  size,
+					  ctlra_usb_xfr_write_done_cb,
+					  async, /* userdata - the async holds
+						    dev to banish it if required */
+					  timeout);
+	else
+		libusb_fill_interrupt_transfer(xfr, dev->usb_handle[idx],
+					       endpoint,
+					       async->buf,
+					       size,
+					       ctlra_usb_xfr_write_done_cb,
+					       async,
+					       timeout);
 
-	libusb_fill_interrupt_transfer(xfr,
-				       dev->usb_handle[idx],
-				       endpoint,
-				       usb_data,
-				       size,
-				       ctlra_usb_xfr_write_done_cb,
-				       dev, /* userdata - pass dev to
-					       banish it if required */
-				       timeout);
 	if(libusb_submit_transfer(xfr) < 0) {
-		libusb_free_transfer(xfr);
-		free(usb_data);
+		ctlra_usb_impl_pool_put(async);
+		dev->usb_xfer_counts[info->stat_error]++;
 		//printf("error submitting data!!\n");
 		return -1;
 	}
 
-	dev->usb_xfer_counts[USB_XFER_INT_WRITE]++;
-	dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE]++;
+	dev->usb_xfer_counts[info->stat_write]++;
+	dev->usb_xfer_counts[info->stat_inflight]++;
 
 	/* do we want to return the size here? */
 	/* This read op is async - there *IS* no data written yet */
 	return size;
+}
+
+static void ctlra_usb_impl_pending_submit(struct ctlra_dev_t *dev,
+					  uint32_t lane_idx)
+{
+	const struct usb_lane_info_t *info = &usb_lanes[lane_idx];
+	struct usb_pool_t *pool = dev->usb_pool;
+	if(!pool)
+		return;
+	struct usb_lane_t *lane = &pool->lane[lane_idx];
+
+	/* the device is gone, queued writes will never be delivered */
+	if(dev->banished) {
+		for(int i = 0; i < CTLRA_USB_PENDING_MAX; i++)
+			lane->pending[i].seq = 0;
+		lane->pending_count = 0;
+		return;
+	}
+
+	while(lane->pending_count &&
+	      dev->usb_xfer_counts[info->stat_inflight] < info->inflight_max) {
+		struct usb_pending_t *oldest = 0;
+		for(int i = 0; i < CTLRA_USB_PENDING_MAX; i++) {
+			struct usb_pending_t *p = &lane->pending[i];
+			if(p->seq && (!oldest || p->seq < oldest->seq))
+				oldest = p;
+		}
+
+		/* the entry is released before submitting, so a failed
+		 * submit is dropped just like a failed direct write */
+		oldest->seq = 0;
+		lane->pending_count--;
+		ctlra_usb_impl_write_submit(dev, lane_idx, oldest->idx,
+					    oldest->endpoint, 0, oldest->size,
+					    oldest->t_queued, oldest);
+	}
+}
+
+/* Submits the write directly, or queues it if the lane is at its
+ * in-flight limit. Writes that match a queued entry are always queued,
+ * else the older queued payload could be sent after this one */
+static int
+ctlra_usb_impl_write(struct ctlra_dev_t *dev, uint32_t lane_idx,
+		     uint32_t idx, uint32_t endpoint, uint8_t *data,
+		     uint32_t size, uint32_t key)
+{
+	const struct usb_lane_info_t *info = &usb_lanes[lane_idx];
+	struct usb_pool_t *pool = dev->usb_pool;
+	if(!pool) {
+		dev->usb_xfer_counts[info->stat_error]++;
+		return -ENOSPC;
+	}
+
+	uint64_t now = ctlra_impl_time_ns();
+	struct usb_lane_t *lane = &pool->lane[lane_idx];
+	int inf = dev->usb_xfer_counts[info->stat_inflight];
+	if(inf >= info->inflight_max ||
+	   ctlra_usb_impl_pending_find(lane, idx, endpoint, key, size))
+		return ctlra_usb_impl_pending_add(dev, lane_idx, idx, endpoint,
+						  key, data, size, now);
+
+	return ctlra_usb_impl_write_submit(dev, lane_idx, idx, endpoint,
+					   data, size, now, 0);
+}
+#endif /* CTLRA_USE_ASYNC_XFER */
+
+int ctlra_dev_impl_usb_interrupt_write_key(struct ctlra_dev_t *dev,
+					   uint32_t idx, uint32_t endpoint,
+					   uint8_t *data, uint32_t size,
+					   uint32_t key)
+{
+#if CTLRA_USE_ASYNC_XFER
+	return ctlra_usb_impl_write(dev, USB_LANE_INT, idx, endpoint,
+				    data, size, key);
 #else
+	int transferred;
+	const uint32_t timeout = 0;
 	int r = libusb_interrupt_transfer(dev->usb_handle[idx], endpoint,
 	                                  data, size, &transferred, timeout);
 	if(r == LIBUSB_ERROR_TIMEOUT)
@@ -718,70 +1899,32 @@ int ctlra_dev_impl_usb_interrupt_write(struct ctlra_dev_t *dev, uint32_t idx,
 #endif /* CTLRA_USE_ASYNC_XFER */
 }
 
+int ctlra_dev_impl_usb_interrupt_write(struct ctlra_dev_t *dev, uint32_t idx,
+                                       uint32_t endpoint, uint8_t *data,
+                                       uint32_t size)
+{
+	/* by default, writes are coalesced per report id */
+	return ctlra_dev_impl_usb_interrupt_write_key(dev, idx, endpoint,
+						      data, size, data[0]);
+}
+
 int ctlra_dev_impl_usb_bulk_write(struct ctlra_dev_t *dev, uint32_t idx,
                                   uint32_t endpoint, uint8_t *data,
                                   uint32_t size)
 {
+#if CTLRA_USE_ASYNC_XFER
+	/* Screen frames are coalesced on their header, which identifies the
+	 * screen, and their size, so full and partial redraws stay apart */
+	uint32_t key = data[0];
+	if(size >= 4)
+		key = data[0] | (data[1] << 8) | (data[2] << 16) |
+		      ((uint32_t)data[3] << 24);
+	return ctlra_usb_impl_write(dev, USB_LANE_BULK, idx, endpoint,
+				    data, size, key);
+#else
 	int transferred;
 	struct ctlra_t *ctlra = dev->ctlra_context;
 	const uint32_t timeout = 0;
-
-	int inf = dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE];
-	if(inf >= CTLRA_ASYNC_READ_MAX) {
-		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
-		return 0;
-	}
-
-#if CTLRA_USE_ASYNC_XFER
-	struct libusb_transfer *xfr;
-	xfr = libusb_alloc_transfer(0);
-	if(xfr == 0)
-		CTLRA_ERROR(ctlra, "write xfr == %p!\n", xfr);
-
-	/* see comment in interrupt read for malloc() and async details */
-	struct usb_async_t *async = malloc(size + sizeof(struct usb_async_t));
-	if(!async) {
-		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
-		return -ENOSPC;
-	}
-	XFER_VALIDATE(dev);
-	struct usb_async_t *dev_current = dev->usb_async_next;
-	if(dev_current)
-		dev_current->prev = async;
-	async->next = dev_current;
-	async->prev = 0;
-	dev->usb_async_next = async;
-	XFER_VALIDATE(dev);
-
-	/* back-pointer from async to xfer */
-	async->xfer = xfr;
-
-	void *usb_data = &async->malloc_mem;
-	memcpy(usb_data, data, size);
-
-	libusb_fill_bulk_transfer(xfr, dev->usb_handle[idx],
-				       endpoint,
-				       usb_data,
-				       size,
-				       ctlra_usb_xfr_write_done_cb,
-				       dev, /* userdata - pass dev to
-					       banish it if required */
-				       timeout);
-	if(libusb_submit_transfer(xfr) < 0) {
-		libusb_free_transfer(xfr);
-		free(usb_data);
-		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
-		//printf("error submitting data!!\n");
-		return -1;
-	}
-
-	dev->usb_xfer_counts[USB_XFER_BULK_WRITE]++;
-	dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE]++;
-
-	/* do we want to return the size here? */
-	/* This read op is async - there *IS* no data written yet */
-	return size;
-#else
 	int r = libusb_bulk_transfer(dev->usb_handle[idx], endpoint,
 	                               data, size, &transferred, timeout);
 
@@ -812,9 +1955,189 @@ int ctlra_dev_impl_usb_bulk_write(struct ctlra_dev_t *dev, uint32_t idx,
 #endif /* CTLRA_USE_ASYNC_XFER */
 }
 
+static uint8_t *
+ctlra_usb_impl_fb_alloc(struct ctlra_dev_t *dev, uint32_t idx, uint32_t size,
+			uint8_t *dev_mem)
+{
+#ifdef CTLRA_USB_HAVE_DEV_MEM
+	/* usbfs zero-copy memory: the kernel transfers straight from it */
+	uint8_t *mem = libusb_dev_mem_alloc(dev->usb_handle[idx], size);
+	if(mem) {
+		memset(mem, 0, size);
+		*dev_mem = 1;
+		return mem;
+	}
+#endif
+	*dev_mem = 0;
+	return calloc(1, size);
+}
+
+static void ctlra_usb_impl_fb_free(struct ctlra_usb_fb_t *fb)
+{
+	struct ctlra_dev_t *dev = fb->dev;
+	for(int i = 0; i < 2; i++) {
+		if(!fb->buf[i])
+			continue;
+#ifdef CTLRA_USB_HAVE_DEV_MEM
+		if(fb->dev_mem[i]) {
+			libusb_dev_mem_free(dev->usb_handle[fb->idx],
+					    fb->buf[i], fb->size);
+			fb->buf[i] = 0;
+			continue;
+		}
+#endif
+		free(fb->buf[i]);
+		fb->buf[i] = 0;
+	}
+	if(fb->xfer)
+		libusb_free_transfer(fb->xfer);
+	fb->xfer = 0;
+}
+
+int ctlra_dev_impl_usb_fb_init(struct ctlra_dev_t *dev,
+			       struct ctlra_usb_fb_t *fb,
+			       uint32_t idx, uint32_t endpoint,
+			       uint32_t size)
+{
+	memset(fb, 0, sizeof(*fb));
+	fb->dev = dev;
+	fb->idx = idx;
+	fb->endpoint = endpoint;
+	fb->size = size;
+
+	fb->xfer = libusb_alloc_transfer(0);
+	if(!fb->xfer)
+		goto fail;
+
+	for(int i = 0; i < 2; i++) {
+		fb->buf[i] = ctlra_usb_impl_fb_alloc(dev, idx, size,
+						     &fb->dev_mem[i]);
+		if(!fb->buf[i])
+			goto fail;
+	}
+
+	fb->next = dev->usb_fb_list;
+	dev->usb_fb_list = fb;
+	return 0;
+fail:
+	ctlra_usb_impl_fb_free(fb);
+	return -ENOMEM;
+}
+
+#if CTLRA_USE_ASYNC_XFER
+static int ctlra_usb_impl_fb_submit(struct ctlra_usb_fb_t *fb);
+
+static void ctlra_usb_fb_done_cb(struct libusb_transfer *xfr)
+{
+	struct ctlra_usb_fb_t *fb = xfr->user_data;
+	struct ctlra_dev_t *dev = fb->dev;
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+	fb->in_flight = 0;
+	dev->usb_xfer_counts[USB_XFER_INFLIGHT_BULK]--;
+
+	switch(xfr->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		ctlra_usb_impl_latency(dev, USB_LANE_BULK, fb->t_queued);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		dev->usb_xfer_counts[USB_XFER_CANCELLED]++;
+		dev->usb_xfer_counts[USB_XFER_INFLIGHT_CANCEL]--;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		dev->usb_xfer_counts[USB_XFER_TIMEOUT]++;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_OVERFLOW:
+		CTLRA_DRIVER(ctlra, "Ctlra: USB fb transfer error %s, dev banished.\n",
+			     libusb_error_name(xfr->status));
+		dev->banished = 1;
+		break;
+	default:
+		CTLRA_DRIVER(ctlra, "USB fb transaction has unknown status: %d\n",
+			    xfr->status);
+		break;
+	}
+
+	/* the front buffer is free again, send the deferred frame */
+	if(fb->flush_pending && !dev->banished)
+		ctlra_usb_impl_fb_submit(fb);
+	ctlra_usb_impl_pending_submit(dev, USB_LANE_BULK);
+}
+
+static int ctlra_usb_impl_fb_submit(struct ctlra_usb_fb_t *fb)
+{
+	struct ctlra_dev_t *dev = fb->dev;
+	struct libusb_transfer *xfr = fb->xfer;
+
+	fb->flush_pending = 0;
+	libusb_fill_bulk_transfer(xfr, dev->usb_handle[fb->idx],
+				  fb->endpoint,
+				  fb->buf[fb->back],
+				  fb->size,
+				  ctlra_usb_fb_done_cb,
+				  fb,
+				  0);
+	if(libusb_submit_transfer(xfr) < 0) {
+		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
+		return -1;
+	}
+
+	/* the submitted buffer is now the front, render into the other */
+	fb->in_flight = 1;
+	fb->back ^= 1;
+
+	dev->usb_xfer_counts[USB_XFER_BULK_WRITE]++;
+	dev->usb_xfer_counts[USB_XFER_INFLIGHT_BULK]++;
+	return fb->size;
+}
+#endif /* CTLRA_USE_ASYNC_XFER */
+
+int ctlra_dev_impl_usb_fb_flush(struct ctlra_usb_fb_t *fb)
+{
+	struct ctlra_dev_t *dev = fb->dev;
+	if(dev->banished)
+		return -ENODEV;
+
+	/* the frame stays in this buffer until the next flush swaps back
+	 * to it, so the resume cache can copy it at unbind */
+	fb->flushed = fb->back + 1;
+
+#if CTLRA_USE_ASYNC_XFER
+	if(fb->in_flight) {
+		if(fb->flush_pending)
+			dev->usb_xfer_counts[USB_XFER_BULK_COALESCED]++;
+		else
+			fb->t_queued = ctlra_impl_time_ns();
+		fb->flush_pending = 1;
+		return fb->size;
+	}
+
+	fb->t_queued = ctlra_impl_time_ns();
+	return ctlra_usb_impl_fb_submit(fb);
+#else
+	return ctlra_dev_impl_usb_bulk_write(dev, fb->idx, fb->endpoint,
+					     fb->buf[fb->back], fb->size);
+#endif /* CTLRA_USE_ASYNC_XFER */
+}
+
+static int ctlra_usb_impl_fb_busy(struct ctlra_dev_t *dev)
+{
+	for(struct ctlra_usb_fb_t *fb = dev->usb_fb_list; fb; fb = fb->next)
+		if(fb->in_flight || fb->flush_pending)
+			return 1;
+	return 0;
+}
+
 void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
 {
 	struct ctlra_t *ctlra = dev->ctlra_context;
+	/* a device opened without a probe, by an app's direct
+	 * ctlra_dev_connect(), has no instance until it is linked. It was
+	 * found on the default context */
+	libusb_context *ctx = ctlra ? ctlra->ctx : NULL;
 
 	struct timeval tv;
 	tv.tv_sec = 0;
@@ -823,10 +2146,15 @@ void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
 	/* if there are inflight writes, these are often to disable any
 	 * LEDs or lights on the device. If so, wait a bit, to be nice :)
 	 */
+	struct usb_pool_t *pool = dev->usb_pool;
 	int wait_count = 0;
 	do {
-		libusb_handle_events_timeout(ctlra->ctx, &tv);
-	} while(dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE] &&
+		libusb_handle_events_timeout(ctx, &tv);
+	} while((dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE] ||
+		 dev->usb_xfer_counts[USB_XFER_INFLIGHT_BULK] ||
+		 ctlra_usb_impl_fb_busy(dev) ||
+		 (pool && (pool->lane[USB_LANE_INT].pending_count ||
+			   pool->lane[USB_LANE_BULK].pending_count))) &&
 		wait_count++ < 100);
 
 	int32_t inf_writes = dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE];
@@ -837,9 +2165,26 @@ void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
 
 	ctlra_usb_impl_xfer_release(dev);
 
-	libusb_context *ctx = ctlra->ctx;
+	int ret = libusb_handle_events_completed(ctx, 0);
+
+	/* cancelled xfers must call back before the pool can be freed */
+	wait_count = 0;
+	while(((pool && pool->in_use) || ctlra_usb_impl_fb_busy(dev)) &&
+	      wait_count++ < 100)
+		libusb_handle_events_timeout(ctx, &tv);
+
+	/* dev mem buffers are freed through the handle, so release the
+	 * framebuffers before the handles are closed */
+	for(struct ctlra_usb_fb_t *fb = dev->usb_fb_list; fb; fb = fb->next) {
+		if(fb->in_flight) {
+			CTLRA_WARN(ctlra, "[%s] screen xfer still in flight, leaking fb\n",
+				   dev->info.device);
+			continue;
+		}
+		ctlra_usb_impl_fb_free(fb);
+	}
+	dev->usb_fb_list = 0;
 
-	int ret = libusb_handle_events_completed(ctlra->ctx, 0);
 	int32_t inf_cancels = dev->usb_xfer_counts[USB_XFER_INFLIGHT_CANCEL];
 	if(ret || inf_cancels) {
 		CTLRA_WARN(ctlra,
@@ -864,6 +2209,13 @@ void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
 		}
 	}
 
+	if(dev->usb_handle_probed) {
+		libusb_close(dev->usb_handle_probed);
+		dev->usb_handle_probed = 0;
+	}
+
+	ctlra_usb_impl_pool_free(dev);
+
 	static const char *usb_xfer_str[] = {
 		"Int. Read",
 		"Int. Write",
@@ -875,6 +2227,12 @@ void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
 		"Inflight Read",
 		"Inflight Write",
 		"Inflight Cancel",
+		"Pool High-Water",
+		"Coalesced",
+		"Inflight Bulk",
+		"Bulk Coalesced",
+		"Int. Write Max Latency (us)",
+		"Bulk Write Max Latency (us)",
 	};
 	for(int i = 0; i < USB_XFER_COUNT; i++) {
 		CTLRA_INFO(ctlra, "[%s] usb %s count (type %d) = %d\n",
@@ -885,6 +2243,17 @@ void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
 
 void ctlra_impl_usb_shutdown(struct ctlra_t *ctlra)
 {
+	/* release devices and handles of unprocessed hotplug events */
+	struct usb_hotplug_queue_t *q = ctlra->usb_hotplug;
+	if(q) {
+		for(; q->tail != q->head; q->tail++)
+			ctlra_usb_impl_hotplug_release(
+				&q->ev[q->tail & (CTLRA_HOTPLUG_QUEUE_SIZE-1)]);
+		free(q);
+		ctlra->usb_hotplug = 0;
+	}
+
+	ctlra_usb_impl_identity_free(ctlra);
 
 	if(ctlra->opts.flags_usb_no_own_context)
 		libusb_exit(NULL);
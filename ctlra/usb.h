@@ -32,12 +32,36 @@
 #ifndef CTLRA_USB_H
 #define CTLRA_USB_H
 
+#include <stdint.h>
+
+struct pollfd;
 struct ctlra_t;
+struct ctlra_dev_t;
 
 /* For USB initialization */
 int ctlra_dev_impl_usb_init(struct ctlra_t *ctlra);
+/* Enumerates the USB bus once, connecting every supported device */
+int ctlra_impl_usb_probe(struct ctlra_t *ctlra);
 /* For polling hotplug / other events */
 void ctlra_impl_usb_idle_iter(struct ctlra_t *ctlra);
+/* For waiting on USB in ctlra_get_pollfds(). Returns the number of fds,
+ * of which at most *max* are written. Timeout is in ms, -1 for none */
+int ctlra_impl_usb_get_pollfds(struct ctlra_t *ctlra, struct pollfd *fds,
+			       uint32_t max);
+int ctlra_impl_usb_get_timeout(struct ctlra_t *ctlra);
+/* For re-arming persistent reads that failed to resubmit. Banishes the
+ * device if it has no reads left in flight and they can't be re-armed */
+void ctlra_impl_usb_read_rearm(struct ctlra_dev_t *dev);
+/* For connecting / removing devices queued by the hotplug callback.
+ * Returns the number of events still queued */
+uint32_t ctlra_impl_usb_hotplug_process(struct ctlra_t *ctlra);
+/* For assigning unique_id, and tracking which instance is where */
+int ctlra_impl_usb_identity_bind(struct ctlra_t *ctlra,
+				 struct ctlra_dev_t *dev);
+void ctlra_impl_usb_identity_unbind(struct ctlra_t *ctlra,
+				    struct ctlra_dev_t *dev);
+/* For sending the cached state to a device that returned in time */
+void ctlra_impl_usb_resume(struct ctlra_t *ctlra, struct ctlra_dev_t *dev);
 /* For cleaning up the USB subsystem */
 void ctlra_impl_usb_shutdown(struct ctlra_t *ctlra);
 
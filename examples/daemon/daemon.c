@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <signal.h>
 
 #include "ctlra.h"
@@ -162,13 +163,22 @@ int main()
 {
 	signal(SIGINT, sighndlr);
 
-	struct ctlra_t *ctlra = ctlra_create(NULL);
+	/* lights only change on input, so no periodic feedback wakeups */
+	struct ctlra_create_opts_t opts = {
+		.flags_feedback_on_input = 1,
+	};
+	struct ctlra_t *ctlra = ctlra_create(&opts);
 	int num_devs = ctlra_probe(ctlra, accept_dev_func, 0x0);
 	printf("daemon: connected devices: %d\n", num_devs);
 
+	/* sleep until a controller has input, instead of polling */
+	struct pollfd fds[32];
 	while(!done) {
 		ctlra_idle_iter(ctlra);
-		usleep(1000);
+		int nfds = ctlra_get_pollfds(ctlra, fds, 32);
+		if(nfds > 32)
+			nfds = 32;
+		poll(fds, nfds, ctlra_get_timeout(ctlra));
 	}
 
 	ctlra_exit(ctlra);
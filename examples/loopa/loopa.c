@@ -3,6 +3,8 @@
 #include <string.h>
 #include <jack/jack.h>
 
+#include "ctlra_clock.h"
+
 #include "oav_reverb.h"
 #include "oav_delay.h"
 
@@ -22,6 +24,29 @@ static uint32_t audio_present;
 static uint32_t recording;
 static uint32_t playing;
 
+/* Play and record changes are sent to the JACK thread with the time of
+ * the controller event that caused them, and take effect at the matching
+ * frame, instead of at the start of the next period */
+#define LOOPA_CMD_PLAY 0
+#define LOOPA_CMD_RECORD 1
+#define LOOPA_CMD_MAX 16
+struct loopa_cmd_t {
+	uint64_t timestamp;
+	uint32_t frame;
+	uint8_t type;
+	uint8_t value;
+};
+static struct loopa_cmd_t cmds[LOOPA_CMD_MAX];
+static uint32_t cmd_head;
+static uint32_t cmd_tail;
+
+/* state as requested by the UI thread, ahead of the JACK thread */
+static uint32_t ui_recording;
+static uint32_t ui_playing;
+static uint64_t event_time;
+
+static struct ctlra_clock_t audio_clock;
+
 roomy_t *roomy;
 delay_t *delay;
 
@@ -60,6 +85,59 @@ float loopa_progress()
 	return playhead / (float)length;
 }
 
+void loopa_event_time(uint64_t timestamp)
+{
+	event_time = timestamp;
+}
+
+static void loopa_cmd_push(uint8_t type, uint8_t value)
+{
+	uint32_t tail = __atomic_load_n(&cmd_tail, __ATOMIC_ACQUIRE);
+	if(cmd_head - tail >= LOOPA_CMD_MAX) {
+		printf("loopa: command queue full\n");
+		return;
+	}
+	struct loopa_cmd_t *c = &cmds[cmd_head % LOOPA_CMD_MAX];
+	c->timestamp = event_time;
+	c->type = type;
+	c->value = value;
+	__atomic_store_n(&cmd_head, cmd_head + 1, __ATOMIC_RELEASE);
+}
+
+static void loopa_cmd_apply(const struct loopa_cmd_t *c)
+{
+	switch(c->type) {
+	case LOOPA_CMD_PLAY:
+		playing = c->value;
+		if(playing == 0)
+			playhead = 0;
+		break;
+	case LOOPA_CMD_RECORD:
+		if(recording && c->value == 0)
+			audio_present = 1;
+		recording = c->value;
+		break;
+	}
+}
+
+/* The JACK time of the period start, in ns. On Linux JACK time is
+ * CLOCK_MONOTONIC, as ctlra timestamps are, elsewhere 0 makes the clock
+ * read the time itself */
+static uint64_t
+period_start_ns(void)
+{
+#ifdef __linux__
+	jack_nframes_t frames;
+	jack_time_t usecs;
+	jack_time_t next_usecs;
+	float period_usecs;
+	if(jack_get_cycle_times(client, &frames, &usecs, &next_usecs,
+				&period_usecs) == 0)
+		return usecs * 1000;
+#endif
+	return 0;
+}
+
 int
 process(jack_nframes_t nframes, void *arg)
 {
@@ -71,8 +149,21 @@ process(jack_nframes_t nframes, void *arg)
 
 	memset(out, 0, sizeof (jack_default_audio_sample_t) * nframes);
 
+	/* place the commands of this period at their frame */
+	ctlra_clock_period(&audio_clock, period_start_ns(), nframes);
+	uint32_t head = __atomic_load_n(&cmd_head, __ATOMIC_ACQUIRE);
+	uint32_t tail = cmd_tail;
+	for(uint32_t c = tail; c != head; c++) {
+		struct loopa_cmd_t *cmd = &cmds[c % LOOPA_CMD_MAX];
+		cmd->frame = ctlra_clock_frame_offset(&audio_clock,
+						      cmd->timestamp);
+	}
+
 	input_max[0] = 0.f;
 	for(int i = 0; i < nframes; i++) {
+		while(tail != head && cmds[tail % LOOPA_CMD_MAX].frame <= i)
+			loopa_cmd_apply(&cmds[tail++ % LOOPA_CMD_MAX]);
+
 		float in_abs = fabsf(in[i]);
 		if(input_max[0] < in_abs)
 			input_max[0] = in_abs;
@@ -107,6 +198,10 @@ process(jack_nframes_t nframes, void *arg)
 		out[i] = tmp_out;
 	}
 
+	/* events too late for the loop still apply, in order */
+	while(tail != head)
+		loopa_cmd_apply(&cmds[tail++ % LOOPA_CMD_MAX]);
+	__atomic_store_n(&cmd_tail, tail, __ATOMIC_RELEASE);
 
 	return 0;
 }
@@ -114,9 +209,8 @@ process(jack_nframes_t nframes, void *arg)
 void loopa_playing(int p)
 {
 	printf("playing %d\n", p);
-	playing = p;
-	if(playing == 0)
-		playhead = 0;
+	ui_playing = p;
+	loopa_cmd_push(LOOPA_CMD_PLAY, p);
 }
 
 float loopa_vol_get(int t)
@@ -140,20 +234,18 @@ void loopa_vol_set(int t, float v)
 
 void loopa_playing_toggle()
 {
-	loopa_playing(!playing);
+	loopa_playing(!ui_playing);
 }
 
 void loopa_recording(int r)
 {
-	if(recording && r == 0)
-		audio_present = 1;
-
-	recording = r;
+	ui_recording = r;
+	loopa_cmd_push(LOOPA_CMD_RECORD, r);
 }
 
 void loopa_record_toggle()
 {
-	loopa_recording(!recording);
+	loopa_recording(!ui_recording);
 }
 
 void loopa_reset()
@@ -162,6 +254,8 @@ void loopa_reset()
 	length = 0;
 	recording = 0;
 	playing = 0;
+	ui_recording = 0;
+	ui_playing = 0;
 	audio_present = 0;
 	memset(audio, 0, sizeof(audio));
 }
@@ -205,6 +299,7 @@ int loopa_init()
 
 	uint32_t sr = jack_get_sample_rate(client);
 	printf ("engine sample rate: %" PRIu32 "\n", sr);
+	ctlra_clock_init(&audio_clock, sr, 0);
 
 	input_port = jack_port_register (client, "input",
 	                                 JACK_DEFAULT_AUDIO_TYPE,
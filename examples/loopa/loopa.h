@@ -1,8 +1,15 @@
 #pragma once
 
+#include <stdint.h>
+
 int loopa_init();
 void loopa_exit();
 
+/* Set the arrival time of the controller event being handled. Play and
+ * record changes made while handling it take effect at the audio frame
+ * matching this time */
+void loopa_event_time(uint64_t timestamp);
+
 void loopa_playing(int r);
 void loopa_recording(int r);
 void loopa_reset();
@@ -253,7 +253,10 @@ void tcc_event_proxy(struct ctlra_dev_t* dev,
 		script_compile_file(script);
 	}
 
-	/* Handle events */
+	/* Handle events: any loopa_* play or record change made by the
+	 * script is timed to the moment the event arrived */
+	if(num_events)
+		loopa_event_time(events[0]->timestamp);
 	if(script->event_func)
 		script->event_func(dev, num_events, events, userdata);
 }
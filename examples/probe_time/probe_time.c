@@ -0,0 +1,76 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ctlra.h"
+
+/* Measures how long Ctlra takes to start up and probe the USB bus. Run
+ * with an iteration count as the argument: ./probe_time 100
+ * Add a thread count to open devices in parallel: ./probe_time 100 4
+ *
+ * Devices found are counted and then rejected, so that the result shows
+ * the cost of matching the bus against the registered drivers, and not
+ * of initializing the hardware itself.
+ */
+
+static uint32_t found;
+
+static int accept_dev_func(struct ctlra_t *ctlra,
+			   const struct ctlra_dev_info_t *info,
+			   struct ctlra_dev_t *dev,
+			   void *userdata)
+{
+	found++;
+	return 0;
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	int iters = 20;
+	if(argc > 1)
+		iters = atoi(argv[1]);
+	if(iters < 1)
+		iters = 1;
+
+	struct ctlra_create_opts_t opts = {
+		.debug_level = CTLRA_DEBUG_ERROR,
+	};
+	if(argc > 2) {
+		opts.flags_usb_parallel_open = 1;
+		opts.usb_open_threads = atoi(argv[2]);
+	}
+
+	uint64_t create = 0;
+	uint64_t probe = 0;
+	uint64_t destroy = 0;
+
+	for(int i = 0; i < iters; i++) {
+		uint64_t t0 = time_ns();
+		struct ctlra_t *ctlra = ctlra_create(&opts);
+		uint64_t t1 = time_ns();
+		ctlra_probe(ctlra, accept_dev_func, 0x0);
+		uint64_t t2 = time_ns();
+		ctlra_exit(ctlra);
+		uint64_t t3 = time_ns();
+
+		create += t1 - t0;
+		probe  += t2 - t1;
+		destroy += t3 - t2;
+	}
+
+	printf("%d iterations, %u devices found per probe\n", iters,
+	       found / iters);
+	printf("  create: %8.3f ms\n", create / 1e6 / iters);
+	printf("  probe:  %8.3f ms\n", probe  / 1e6 / iters);
+	printf("  exit:   %8.3f ms\n", destroy / 1e6 / iters);
+
+	return 0;
+}
@@ -238,14 +238,17 @@ int main(int argc, char **argv)
 
 	signal(SIGINT, sighndlr);
 
-	struct ctlra_t *ctlra = ctlra_create(NULL);
+	/* Ctlra handles the devices on its own thread, waking as soon as
+	 * input arrives. The callbacks above are called from that thread */
+	struct ctlra_create_opts_t opts = {
+		.flags_io_thread = 1,
+	};
+	struct ctlra_t *ctlra = ctlra_create(&opts);
 	int num_devs = ctlra_probe(ctlra, accept_dev_func, 0x0);
 	printf("connected devices %d\n", num_devs);
 
-	while(!done) {
-		ctlra_idle_iter(ctlra);
-		usleep(10 * 1000);
-	}
+	while(!done)
+		usleep(100 * 1000);
 
 	ctlra_exit(ctlra);
 
@@ -8,10 +8,27 @@
 
 #include <fluidsynth.h>
 
+#include "ctlra_clock.h"
+
+/* Notes are queued with the timestamp of the controller event, and the
+ * JACK thread starts them at the matching frame of the period */
+#define SOFFA_NOTES_MAX 64
+struct soffa_note_t {
+	uint64_t timestamp;
+	uint8_t chan;
+	uint8_t note;
+	uint8_t vel; /* 0 for note off */
+};
+
 struct soffa_t {
 	fluid_synth_t*    synth;
 	fluid_settings_t* settings;
 	int sf_id;
+
+	struct soffa_note_t notes[SOFFA_NOTES_MAX];
+	uint32_t note_head;
+	uint32_t note_tail;
+	struct ctlra_clock_t clock;
 };
 
 struct soffa_t *
@@ -23,6 +40,7 @@ soffa_init(uint32_t sr)
 	s->settings = new_fluid_settings();
 	s->synth = new_fluid_synth(s->settings);
 	fluid_synth_set_sample_rate(s->synth, sr);
+	ctlra_clock_init(&s->clock, sr, 0);
 
 	/* TODO: fluid_synth_sfunload(); */
 
@@ -46,16 +64,36 @@ fail:
 	return 0;
 }
 
+static void
+soffa_note_push(struct soffa_t *s, uint64_t timestamp, uint8_t chan,
+		uint8_t note, uint8_t vel)
+{
+	uint32_t tail = __atomic_load_n(&s->note_tail, __ATOMIC_ACQUIRE);
+	if(s->note_head - tail >= SOFFA_NOTES_MAX) {
+		printf("soffa: note queue full, dropping note %d\n", note);
+		return;
+	}
+	struct soffa_note_t *n = &s->notes[s->note_head % SOFFA_NOTES_MAX];
+	n->timestamp = timestamp;
+	n->chan = chan;
+	n->note = note;
+	n->vel = vel;
+	__atomic_store_n(&s->note_head, s->note_head + 1, __ATOMIC_RELEASE);
+}
+
 void
-soffa_note_on(struct soffa_t *s, uint8_t chan, uint8_t note, float vel)
+soffa_note_on(struct soffa_t *s, uint64_t timestamp, uint8_t chan,
+	      uint8_t note, float vel)
 {
-	fluid_synth_noteon(s->synth, chan, note, vel * 127.f);
+	uint8_t v = vel * 127.f;
+	soffa_note_push(s, timestamp, chan, note, v ? v : 1);
 }
 
 void
-soffa_note_off(struct soffa_t *s, uint8_t chan, uint8_t note)
+soffa_note_off(struct soffa_t *s, uint64_t timestamp, uint8_t chan,
+	       uint8_t note)
 {
-	fluid_synth_noteoff(s->synth, chan, note);
+	soffa_note_push(s, timestamp, chan, note, 0);
 }
 
 void
@@ -71,12 +109,43 @@ soffa_set_patch(struct soffa_t *s, uint8_t chan,
 	}
 }
 
-void soffa_process(struct soffa_t *s, int nframes, float** output)
+static void
+soffa_render(struct soffa_t *s, int nframes, float **output, int offset)
 {
+	if(nframes <= 0)
+		return;
 	int ignored = 0;
 	void *ignore_ptr = 0;
+	float *out[] = {output[0] + offset, output[1] + offset};
 	fluid_synth_process(s->synth, nframes, ignored, ignore_ptr,
-			    2, output);
+			    2, out);
+}
+
+void soffa_process(struct soffa_t *s, uint64_t period_ns, int nframes,
+		   float** output)
+{
+	ctlra_clock_period(&s->clock, period_ns, nframes);
+
+	/* render up to each queued note, then start it. Timestamps are
+	 * in arrival order, so the offsets never go backwards */
+	uint32_t head = __atomic_load_n(&s->note_head, __ATOMIC_ACQUIRE);
+	uint32_t tail = s->note_tail;
+	int done = 0;
+	for(; tail != head; tail++) {
+		struct soffa_note_t *n = &s->notes[tail % SOFFA_NOTES_MAX];
+		int pos = ctlra_clock_frame_offset(&s->clock, n->timestamp);
+		if(pos > done) {
+			soffa_render(s, pos - done, output, done);
+			done = pos;
+		}
+		if(n->vel)
+			fluid_synth_noteon(s->synth, n->chan, n->note, n->vel);
+		else
+			fluid_synth_noteoff(s->synth, n->chan, n->note);
+	}
+	__atomic_store_n(&s->note_tail, tail, __ATOMIC_RELEASE);
+
+	soffa_render(s, nframes - done, output, done);
 }
 
 jack_port_t* outputPort = 0;
@@ -88,6 +157,24 @@ float* sample;
 
 static jack_client_t* client;
 
+/* The JACK time of the period start, in ns. On Linux JACK time is
+ * CLOCK_MONOTONIC, as ctlra timestamps are, elsewhere 0 makes the clock
+ * read the time itself */
+static uint64_t
+period_start_ns(void)
+{
+#ifdef __linux__
+	jack_nframes_t frames;
+	jack_time_t usecs;
+	jack_time_t next_usecs;
+	float period_usecs;
+	if(jack_get_cycle_times(client, &frames, &usecs, &next_usecs,
+				&period_usecs) == 0)
+		return usecs * 1000;
+#endif
+	return 0;
+}
+
 int process(jack_nframes_t nframes, void* arg)
 {
 	struct dummy_data *d = arg;
@@ -107,7 +194,7 @@ int process(jack_nframes_t nframes, void* arg)
 	}
 
 	float *buf2[] = {outputBuffer, outputBuffer};
-	soffa_process(d->soffa, nframes, buf2);
+	soffa_process(d->soffa, period_start_ns(), nframes, buf2);
 
 	for (int i = 0; i < (int) nframes; i++) {
 		outputBuffer[i] *= 2;
@@ -32,8 +32,12 @@ void audio_exit();
 /* SF2 sound generation */
 void soffa_set_patch(struct soffa_t *s, uint8_t chan,
 		     uint8_t bank, uint8_t patch, const char **name);
-void soffa_note_on(struct soffa_t *s, uint8_t chan, uint8_t note, float vel);
-void soffa_note_off(struct soffa_t *s, uint8_t chan, uint8_t note);
+/* timestamp is the ctlra_event_t timestamp, used to place the note in
+ * the audio period */
+void soffa_note_on(struct soffa_t *s, uint64_t timestamp, uint8_t chan,
+		   uint8_t note, float vel);
+void soffa_note_off(struct soffa_t *s, uint64_t timestamp, uint8_t chan,
+		    uint8_t note);
 
 /* Functions to poll / push state to the devs */
 void kontrol_x1_update_state(struct ctlra_dev_t *dev, void *d);
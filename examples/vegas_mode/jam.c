@@ -59,11 +59,13 @@ void jam_func(struct ctlra_dev_t* dev,
 			if (e->grid.flags & CTLRA_EVENT_GRID_FLAG_BUTTON) {
 				d->buttons[e->grid.pos] = e->grid.pressed;
 				if(e->grid.pressed) {
-					soffa_note_on(d->soffa, 0, 36 + e->grid.pos, 0.7);
+					soffa_note_on(d->soffa, e->timestamp, 0,
+						      36 + e->grid.pos, 0.7);
 					printf("jam note on %d\n", e->grid.pos);
 				}
 				else
-					soffa_note_off(d->soffa, 0, 36 + e->grid.pos);
+					soffa_note_off(d->soffa, e->timestamp, 0,
+						       36 + e->grid.pos);
 			}
 		default:
 			break;
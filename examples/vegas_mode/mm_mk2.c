@@ -104,10 +104,12 @@ void mm_pads(struct ctlra_dev_t* dev,
 			if(e->grid.flags & CTLRA_EVENT_GRID_FLAG_BUTTON) {
 				dummy->buttons[e->grid.pos] = e->grid.pressed;
 				if(e->grid.pressed)
-					soffa_note_on(dummy->soffa, 0, 36 + e->grid.pos,
+					soffa_note_on(dummy->soffa, e->timestamp,
+						      0, 36 + e->grid.pos,
 						      0.3 + 0.7 * e->grid.pressure);
 				else
-					soffa_note_off(dummy->soffa, 0, 36 + e->grid.pos);
+					soffa_note_off(dummy->soffa, e->timestamp,
+						       0, 36 + e->grid.pos);
 			}
 			break;
 		default: